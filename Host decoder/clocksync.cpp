@@ -0,0 +1,74 @@
+// Estimation du décalage et de la dérive de l'horloge de la Maple par ping/écho
+// Matthias Lemainque 2013
+
+#include "clocksync.h"
+
+CLOCKSYNC::CLOCKSYNC() {
+  nSamples = 0;
+  posSample = 0;
+  deviceHigh = 0;
+  deviceLast = 0;
+  fitted = false;
+  drift = 0;
+  rttMin = 0;
+}
+
+uint8_t CLOCKSYNC::ping(uint8_t seq, uint32_t hostTime, uint8_t *frame) {
+  uint8_t cmd[1+4];
+  cmd[0] = CMD_PING;
+  for (uint8_t i=0 ; i<4 ; i++) cmd[1+i] = hostTime >> (24 - 8*i);
+  return frameEncode(seq, cmd, sizeof(cmd), frame);
+}
+
+// Les écarts sont calculés sur 32 bits signés : justes tant que l'échange dure moins de 35 min
+void CLOCKSYNC::echo(uint32_t t1, uint32_t t2, uint32_t t3, uint32_t t4) {
+  if ((nSamples > 0) && (t2 < deviceLast)) deviceHigh += 1ULL << 32;
+  deviceLast = t2;
+
+  SAMPLE *s = &samples[posSample];
+  s->time = (double)(deviceHigh | t2);
+  s->rtt = (double)(int32_t)(t4 - t1) - (double)(int32_t)(t3 - t2);
+  s->offset = ((double)(int32_t)(t2 - t1) + (double)(int32_t)(t3 - t4)) / 2;
+  posSample = (posSample + 1) % CLOCK_SAMPLES;
+  if (nSamples < CLOCK_SAMPLES) nSamples++;
+  fit();
+}
+
+// Moindres carrés sur les échanges dont l'aller-retour dépasse le minimum de moins de 50 %
+void CLOCKSYNC::fit() {
+  rttMin = samples[0].rtt;
+  for (uint8_t i=1 ; i<nSamples ; i++)
+    if (samples[i].rtt < rttMin) rttMin = samples[i].rtt;
+  double limit = 1.5*rttMin + 200;
+
+  uint8_t n = 0;
+  double sx = 0, sy = 0;
+  for (uint8_t i=0 ; i<nSamples ; i++) {
+    if (samples[i].rtt > limit) continue;
+    sx += samples[i].time;
+    sy += samples[i].offset;
+    n++;
+  }
+  time0 = sx / n;
+  offset0 = sy / n;
+  double sxx = 0, sxy = 0;
+  for (uint8_t i=0 ; i<nSamples ; i++) {
+    if (samples[i].rtt > limit) continue;
+    double dx = samples[i].time - time0;
+    sxx += dx*dx;
+    sxy += dx*(samples[i].offset - offset0);
+  }
+  drift = (n > 1) && (sxx > 0) ? sxy / sxx * 1e6 : 0;
+  fitted = true;
+}
+
+bool CLOCKSYNC::isValid() {
+  return fitted;
+}
+
+// La date est supposée à moins de 35 min du dernier écho reçu
+uint32_t CLOCKSYNC::toHost(uint32_t deviceTime) {
+  double time = (double)(deviceHigh | deviceLast) + (int32_t)(deviceTime - deviceLast);
+  int64_t offset = (int64_t)(offset0 + drift*1e-6*(time - time0) + 0.5);
+  return deviceTime - (uint32_t)offset;
+}
@@ -0,0 +1,49 @@
+// Estimation du décalage et de la dérive de l'horloge de la Maple par ping/écho
+// Matthias Lemainque 2013
+
+#ifndef _CLOCKSYNC_H_
+#define _CLOCKSYNC_H_
+
+#include <stdint.h>
+#include "../Maple Mini Code v2/framing.h"
+
+#define PING_LENGTH		FRAME_LENGTH(1+4)	// Trame de CMD_PING suivi de la date du client sur 4 octets
+#define CLOCK_SAMPLES		32	// Echanges conservés pour l'estimation
+
+// Le client envoie ping(t1) ; la Maple répond ECHO(t1, t2, t3) avec t2 la date de réception
+// et t3 la date d'émission (µs, horloge de la Maple) ; le client le reçoit à t4. Alors :
+//   aller-retour = (t4-t1) - (t3-t2)   décalage = ((t2-t1) + (t3-t4)) / 2
+// Le décalage n'est juste que si l'aller et le retour durent autant : on ne retient que les
+// échanges dont l'aller-retour est proche du minimum, puis on ajuste une droite (décalage et
+// dérive) sur leur date.
+class CLOCKSYNC {
+private:
+  struct SAMPLE {
+    double time;	// Date de la Maple (µs, étendue)
+    double offset;	// Horloge de la Maple - horloge du client (µs, modulo 2^32 : les deux bouclent)
+    double rtt;		// Aller-retour (µs)
+  };
+  SAMPLE samples[CLOCK_SAMPLES];
+  uint8_t nSamples, posSample;
+
+  uint64_t deviceHigh;	// Extension à 64 bits des dates de la Maple
+  uint32_t deviceLast;
+  bool fitted;
+  double time0, offset0;
+
+  void fit();
+
+public:
+  CLOCKSYNC();
+
+  uint8_t ping(uint8_t seq, uint32_t hostTime, uint8_t *frame);	// Trame à envoyer (PING_LENGTH octets au plus), renvoit sa longueur
+  void echo(uint32_t t1, uint32_t t2, uint32_t t3, uint32_t t4);
+
+  bool isValid();
+  uint32_t toHost(uint32_t deviceTime);	// Date de la Maple (µs) -> date du client (µs), sur 32 bits
+
+  double drift;		// Dérive de l'horloge de la Maple (ppm)
+  double rttMin;	// Plus court aller-retour observé (µs)
+};
+
+#endif // _CLOCKSYNC_H_
@@ -0,0 +1,220 @@
+// Décodage sur l'ordinateur client du flux de télémétrie de LOG
+// Matthias Lemainque 2013
+
+#include <string.h>
+#include "decoder.h"
+
+DECODER::DECODER(FIELD_HANDLER newHandler) {
+  handler = newHandler;
+  memset(maskMain, MASK_END, sizeof(maskMain));
+  memset(maskNext, MASK_END, sizeof(maskNext));
+  gen = 0;
+  genValid = false;
+  genNext = 0;
+  announced = 0;
+  maskPending = false;
+  nFrame = 0;
+  overflow = false;
+  seqValid = false;
+  lastValid = false;
+  syncTime = 0;
+  syncSeen = false;
+  syncValid = false;
+  packets = 0;
+  errors = 0;
+  stale = 0;
+  drops = 0;
+}
+
+// Un masque incomplet est complété par MASK_END. Sa génération est celle du paquet suivant
+void DECODER::setMask(const uint8_t *newMain) {
+  memcpy(maskMain, newMain, MAIN_MASK_LENGTH);
+  genValid = false;
+  maskPending = false;
+  seqValid = false;
+  lastValid = false;
+}
+
+// Le codage différentiel dépend des trames précédentes : il faut attendre une image clé ;
+// une SYNC a pu être perdue : il faut attendre la suivante pour dater les paquets. La SYNC
+// précédente reste la référence du débordement de micros(), tant que la perte dure moins de 71 min.
+// Une annonce en cours a pu perdre des mots : il faut attendre sa répétition.
+void DECODER::lost() {
+  lastValid = false;
+  syncValid = false;
+  announced = 0;
+}
+
+// Les mots du masque s'accumulent dans maskNext ; PARAM_MASK_GEN clôt l'annonce, retenue
+// seulement si tous les mots sont arrivés depuis la dernière perte. Le codage (PARAM_DELTA)
+// est lu dans l'en-tête de chaque paquet.
+void DECODER::announce(uint32_t id, uint32_t value) {
+  if ((id >= PARAM_MASK_MAIN) && (id < PARAM_MASK_MAIN + TM_MASK_WORDS(MAIN_MASK_LENGTH))) {
+    tmMaskUnword(value, maskNext, MAIN_MASK_LENGTH, id - PARAM_MASK_MAIN);
+    announced |= 1 << (id - PARAM_MASK_MAIN);
+  }
+  else if (id == PARAM_MASK_GEN) {
+    if (announced == (1 << TM_MASK_WORDS(MAIN_MASK_LENGTH)) - 1) {
+      genNext = value & TM_GEN_MASK;
+      maskPending = true;
+    }
+    announced = 0;
+  }
+}
+
+// Masque du paquet de génération newGen : faux s'il n'a pas été reçu. Une annonce répétant
+// le masque en vigueur ne coûte pas d'image clé.
+bool DECODER::useMask(uint8_t newGen) {
+  if (!genValid || (newGen != gen)) {
+    if (maskPending && (newGen == genNext)) {
+      memcpy(maskMain, maskNext, MAIN_MASK_LENGTH);
+      lastValid = false;
+    }
+    else if (genValid) return false;
+    gen = newGen;
+    genValid = true;
+  }
+  if (maskPending && (genNext == gen)) maskPending = false;
+  return true;
+}
+
+void DECODER::emit(uint8_t code, const uint32_t *q, bool aux) {
+  double v[TM_MAX_COUNT];
+  switch (code) {
+  case MASK_SYNC :
+    if (syncSeen && (q[0] < (uint32_t)syncTime)) syncTime += 1ULL << 32;
+    syncTime = (syncTime & ~0xFFFFFFFFULL) | q[0];
+    syncSeen = true;
+    syncValid = true;
+    v[0] = syncTime * 1e-6;
+    break;
+  case MASK_TIME :
+    if (!syncValid) return;
+    v[0] = (syncTime + q[0]) * 1e-6;
+    break;
+  case MASK_PARAM :
+    announce(q[0], q[1]);
+    // Pas de break : transmis brut comme les autres réponses
+  case MASK_ECHO :
+  case MASK_ACK :
+  case MASK_PERF :
+    for (uint8_t i=0 ; i<TM_MAX_COUNT ; i++) v[i] = q[i];
+    break;
+  default :
+    float f[TM_MAX_COUNT];
+    tmDequantize(code, q, f);
+    for (uint8_t i=0 ; i<TM_MAX_COUNT ; i++) v[i] = f[i];
+  }
+  handler(packets, code, v, aux);
+}
+
+// Les octets sont accumulés jusqu'au délimiteur : une trame corrompue ne coûte qu'elle-même
+void DECODER::push(uint8_t data) {
+  if (data != FRAME_DELIMITER) {
+    if (nFrame < FRAME_MAX_LENGTH) frame[nFrame++] = data;
+    else overflow = true;
+    return;
+  }
+  if ((nFrame > 0) || overflow) receiveFrame();
+  nFrame = 0;
+  overflow = false;
+}
+
+void DECODER::receiveFrame() {
+  uint8_t packet[FRAME_MAX_LENGTH];
+  uint16_t n = overflow ? 0 : cobsDecode(frame, nFrame, packet);
+  if ((n < FRAME_HEADER + FRAME_CRC) ||
+      (crc16(packet, n-FRAME_CRC) != ((packet[n-2] << 8) | packet[n-1]))) {
+    errors++;
+    lost();
+    return;
+  }
+
+  // Trames manquantes entre la précédente et celle-ci
+  uint8_t gap = packet[0] - (uint8_t)(seq + 1);
+  if (seqValid && gap) {
+    drops += gap;
+    lost();
+  }
+  seq = packet[0];
+  seqValid = true;
+
+  if (parse(packet+FRAME_HEADER, n-FRAME_HEADER-FRAME_CRC)) packets++;
+  else {
+    errors++;
+    lost();
+  }
+}
+
+// Le paquet doit être lu exactement jusqu'au bout ; les valeurs ne sont retenues qu'alors.
+// Seule exception, le paquet d'un masque non reçu : les champs hors masque, en tête, sont lus
+// (dont l'annonce du masque), le reste est ignoré.
+bool DECODER::parse(const uint8_t *packet, uint16_t n) {
+  if (n < 1) return false;
+  uint16_t pos = 0;
+  uint8_t header = packet[pos++];
+  uint8_t frameType = TM_HEADER_FRAME(header);
+  if (frameType > TM_FRAME_DELTA) return false;
+
+  // Champs hors masque : SYNC et réponses
+  uint8_t nReply = TM_HEADER_REPLIES(header);
+  uint8_t replyCodes[TM_MAX_REPLIES];
+  uint32_t replies[TM_MAX_REPLIES][TM_MAX_COUNT];
+  for (uint8_t i=0 ; i<nReply ; i++) {
+    if (pos >= n) return false;
+    uint8_t code = packet[pos++];
+    if ((code < TM_FIRST_REPLY) || (tmLength(code) == 0) || (pos + tmLength(code) > n)) return false;
+    replyCodes[i] = code;
+    pos += tmUnpack(code, packet+pos, replies[i]);
+  }
+  if (!useMask(TM_HEADER_GEN(header))) {
+    stale++;
+    lastValid = false;
+    for (uint8_t i=0 ; i<nReply ; i++) emit(replyCodes[i], replies[i], true);
+    return true;
+  }
+
+  uint8_t nMain = 0;
+  uint8_t codes[MAIN_MASK_LENGTH];
+  uint32_t values[MAIN_MASK_LENGTH][TM_MAX_COUNT];
+  uint32_t ref[TM_FIELDS][TM_MAX_COUNT];
+  memcpy(ref, last, sizeof(ref));
+  for (uint8_t i=0 ; i<MAIN_MASK_LENGTH ; i++) {
+    uint8_t code = maskMain[i];
+    uint8_t len = tmLength(code);
+    if (len == 0) break;
+    if (code == MASK_KEY) { // La clé n'est plus vérifiée : le CRC de la trame la remplace
+      pos++;
+      continue;
+    }
+    uint16_t avail = (n > pos) ? n - pos : 0;
+    if (frameType == TM_FRAME_DELTA) {
+      len = tmUnpackDelta(code, packet+pos, (avail > 255) ? 255 : avail, ref[code], values[nMain]);
+      if (len == 0) return false;
+    }
+    else {
+      if (avail < len) return false;
+      tmUnpack(code, packet+pos, values[nMain]);
+    }
+    if (frameType != TM_FRAME_ABS) memcpy(ref[code], values[nMain], sizeof(ref[code]));
+    codes[nMain++] = code;
+    pos += len;
+  }
+  // Paquet auxiliaire : suite de champs précédés de leur code, jusqu'à la fin du paquet
+  for (uint16_t i=pos ; i<n ; i+=1+tmLength(packet[i]))
+    if ((tmLength(packet[i]) == 0) || (packet[i] == MASK_KEY) || (i+1+tmLength(packet[i]) > n)) return false;
+
+  // Paquet valide
+  if (frameType == TM_FRAME_KEY) lastValid = true;
+  memcpy(last, ref, sizeof(last));
+  for (uint8_t i=0 ; i<nReply ; i++) emit(replyCodes[i], replies[i], true);
+  if ((frameType != TM_FRAME_DELTA) || lastValid)
+    for (uint8_t i=0 ; i<nMain ; i++) emit(codes[i], values[i], false);
+  while (pos < n) {
+    uint8_t code = packet[pos++];
+    uint32_t q[TM_MAX_COUNT];
+    pos += tmUnpack(code, packet+pos, q);
+    emit(code, q, true);
+  }
+  return true;
+}
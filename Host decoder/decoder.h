@@ -0,0 +1,65 @@
+// Décodage sur l'ordinateur client du flux de télémétrie de LOG
+// Matthias Lemainque 2013
+
+#ifndef _DECODER_H_
+#define _DECODER_H_
+
+#include <stdint.h>
+#include "../Maple Mini Code v2/telemetry.h"
+#include "../Maple Mini Code v2/framing.h"
+
+// Appelée pour chaque champ décodé (aux : champ issu du paquet auxiliaire). TIME et SYNC sont
+// convertis en date absolue de la Maple (s) ; ECHO (µs, cf. CLOCKSYNC) et les autres réponses
+// aux commandes (ACK, PARAM, PERF) sont transmis bruts.
+typedef void (*FIELD_HANDLER)(uint32_t packet, uint8_t code, const double *v, bool aux);
+
+class DECODER {
+private:
+  uint8_t maskMain[MAIN_MASK_LENGTH];
+  uint8_t gen;		// Génération de maskMain (cf. framing.h)
+  bool genValid;	// Faux jusqu'au premier paquet, qui suit le masque donné au départ
+
+  // Masque annoncé par la Maple (PARAM, cf. framing.h) : appliqué au premier paquet de sa génération
+  uint8_t maskNext[MAIN_MASK_LENGTH];
+  uint8_t genNext;
+  uint8_t announced;	// Mots de maskNext reçus depuis la dernière perte (un bit par mot)
+  bool maskPending;	// Annonce complète, en attente d'un paquet de la génération genNext
+  void announce(uint32_t id, uint32_t value);
+  bool useMask(uint8_t newGen);
+
+  // Trame en cours de réception (avant décodage COBS)
+  uint8_t frame[FRAME_MAX_LENGTH];
+  uint16_t nFrame;
+  bool overflow;
+  uint8_t seq;
+  bool seqValid;
+
+  // Codage différentiel : dernières valeurs reçues, valables depuis la dernière image clé
+  uint32_t last[TM_FIELDS][TM_MAX_COUNT];
+  bool lastValid;
+
+  // Date absolue de la dernière SYNC, étendue à 64 bits (micros() boucle en 71 min)
+  uint64_t syncTime;
+  bool syncSeen;	// Une SYNC a déjà été reçue : syncTime sert de référence pour le débordement
+  bool syncValid;	// Aucune trame perdue depuis la dernière SYNC : les TIME peuvent être datés
+
+  FIELD_HANDLER handler;
+  void emit(uint8_t code, const uint32_t *q, bool aux);
+
+  void receiveFrame();
+  bool parse(const uint8_t *packet, uint16_t n);
+  void lost();
+
+public:
+  DECODER(FIELD_HANDLER newHandler);
+
+  void setMask(const uint8_t *newMain);
+  void push(uint8_t data);
+
+  uint32_t packets;	// Paquets valides
+  uint32_t errors;	// Trames rejetées (CRC, COBS, longueur)
+  uint32_t stale;	// Paquets d'un masque non reçu : seuls les champs hors masque sont lus
+  uint32_t drops;	// Trames manquantes d'après les numéros de séquence
+};
+
+#endif // _DECODER_H_
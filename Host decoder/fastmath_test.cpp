@@ -0,0 +1,81 @@
+// Banc d'essai de fastmath : précision par rapport à libm (double) et débit
+// Matthias Lemainque 2013
+//
+// Compilation : g++ -O2 -o fastmath_test fastmath_test.cpp "../Maple Mini Code v2/fastmath.cpp"
+// Renvoit 1 si une erreur dépasse la borne annoncée dans fastmath.h
+//
+// Les durées sont mesurées sur l'ordinateur, qui a une unité flottante : elles ne donnent
+// que le rapport entre fastmath et libm. Sur la Maple, les cycles réels se lisent par zone
+// de code avec CMD_PERF (profile.h).
+
+#include <stdio.h>
+#include <math.h>
+#include <time.h>
+#include "../Maple Mini Code v2/fastmath.h"
+
+#define N_ACCURACY	1000000
+#define N_SPEED		10000000
+
+static int failures = 0;
+
+static void check(const char *name, double err, double bound, const char *unit) {
+  bool ok = (err < bound);
+  if (!ok) failures++;
+  printf("%-12s erreur maxi %.3g %s (borne %.3g)%s\n", name, err, unit, bound, ok ? "" : "  ECHEC");
+}
+
+static double now() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+// Empêche le compilateur de supprimer les appels mesurés
+static volatile float sink;
+
+#define SPEED(name, expr)						\
+  {									\
+    float acc = 0;							\
+    double t0 = now();							\
+    for (int i=0 ; i<N_SPEED ; i++) { float x = xs[i & 1023]; (void)x; acc += (expr); }	\
+    sink = acc;								\
+    printf("  %-24s %6.2f ns/appel\n", name, (now()-t0)*1e9/N_SPEED);	\
+  }
+
+int main() {
+  // * * * Précision * * *
+  double errInvSqrt = 0, errAtan2 = 0, errAsin = 0, errBaro = 0;
+  for (int i=0 ; i<N_ACCURACY ; i++) {
+    double x = 1e-6 * pow(1e12, (double)i/N_ACCURACY); // 1e-6 à 1e6
+    errInvSqrt = fmax(errInvSqrt, fabs(fastInvSqrt(x)*sqrt(x) - 1));
+
+    double a = 2*M_PI*i/N_ACCURACY - M_PI;
+    double y = sin(a), z = cos(a);
+    errAtan2 = fmax(errAtan2, fabs(fastAtan2(y, z) - atan2((float)y, (float)z)));
+
+    double s = 2.0*i/N_ACCURACY - 1;
+    errAsin = fmax(errAsin, fabs(fastAsin(s) - asin(s)));
+
+    double r = 0.05 + 19.95*i/N_ACCURACY; // Rapports de pression de 0.05 à 20
+    errBaro = fmax(errBaro, fabs(fastPowBaro(r) / pow((float)r, 1/5.255) - 1));
+  }
+  check("fastInvSqrt", errInvSqrt, 5e-6, "(relative)");
+  check("fastAtan2", errAtan2, 1.2e-5, "rad");
+  check("fastAsin", errAsin, 2e-5, "rad");
+  check("fastPowBaro", errBaro, 1e-6, "(relative)");
+
+  // * * * Débit * * *
+  float xs[1024];
+  for (int i=0 ; i<1024 ; i++) xs[i] = 0.5f + i/1024.f;
+  printf("Débit (ordinateur) :\n");
+  SPEED("fastInvSqrt", fastInvSqrt(x));
+  SPEED("1/sqrtf", 1/sqrtf(x));
+  SPEED("fastAtan2", fastAtan2(x-1, 0.7f));
+  SPEED("atan2f", atan2f(x-1, 0.7f));
+  SPEED("fastAsin", fastAsin(x-1));
+  SPEED("asinf", asinf(x-1));
+  SPEED("fastPowBaro", fastPowBaro(x));
+  SPEED("powf", powf(x, 1/5.255f));
+
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,112 @@
+// Décodeur de télémétrie en ligne de commande
+// Matthias Lemainque 2013
+//
+// Compilation : g++ -O2 -o decode main.cpp decoder.cpp clocksync.cpp
+// Usage       : decode <fichier|-> <masque principal> [ping <port série>]
+//   ex.       : decode "LOG_000.BIN" 2,7,10,15
+//               decode /dev/ttyUSB0 2,7,10,15 ping /dev/ttyUSB0
+// Sortie      : une ligne CSV par champ décodé : paquet;main|aux;nom;valeurs...
+//               avec ping, une ligne par écho : paquet;clock;dérive (ppm);aller-retour mini (µs)
+//
+// Le masque donné est celui du début du flux ; ses changements ultérieurs sont annoncés par la
+// Maple et suivis par le décodeur (cf. framing.h). Le codage est lu dans chaque paquet.
+//
+// Avec ping, le flux est supposé lu en direct : un ping est envoyé par seconde au plus, et
+// la date de réception de chaque ECHO alimente CLOCKSYNC.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "decoder.h"
+#include "clocksync.h"
+
+#define PING_INTERVAL		1000000	// µs
+
+static FILE *pingPort = NULL;
+static CLOCKSYNC clockSync;
+static uint8_t pingSeq = 0;
+static uint32_t lastPing = 0;
+
+// Horloge du client (µs, boucle comme micros() de la Maple)
+static uint32_t hostMicros() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint32_t)(ts.tv_sec*1000000ULL + ts.tv_nsec/1000);
+}
+
+static void sendPing() {
+  uint8_t frame[PING_LENGTH];
+  uint32_t now = hostMicros();
+  uint8_t len = clockSync.ping(pingSeq++, now, frame);
+  fwrite(frame, 1, len, pingPort);
+  fflush(pingPort);
+  lastPing = now;
+}
+
+static void printField(uint32_t packet, uint8_t code, const double *v, bool aux) {
+  const TM_FIELD *f = &TM_SCHEMA[code];
+  uint8_t n = (f->codec == TM_QUAT) ? 4 : f->count;
+  printf("%u;%s;%s", packet, aux ? "aux" : "main", f->name);
+  uint8_t i = 0;
+  if (code == MASK_PERF) { // Zone et nombre de mesures partagent la première valeur
+    uint32_t zone = v[i++];
+    printf(";%u;%u", zone >> 24, zone & 0xFFFFFF);
+  }
+  for ( ; i<n ; i++) printf(";%.9g", v[i]);
+  printf("\n");
+
+  // ECHO : date du client au ping, réception et émission par la Maple ; on y ajoute la date
+  // de réception par le client, prise au plus près (l'appel suit la fin de la trame)
+  if ((pingPort != NULL) && (code == MASK_ECHO)) {
+    clockSync.echo(v[0], v[1], v[2], hostMicros());
+    if (clockSync.isValid()) printf("%u;clock;%.3f;%.0f\n", packet, clockSync.drift, clockSync.rttMin);
+  }
+}
+
+// Liste de codes séparés par des virgules
+static void parseMask(const char *str, uint8_t *mask, uint8_t len) {
+  memset(mask, MASK_END, len);
+  for (uint8_t i=0 ; (i<len) && (*str) ; i++) {
+    mask[i] = strtoul(str, (char**)&str, 10);
+    if (*str == ',') str++;
+  }
+}
+
+int main(int argc, char **argv) {
+  if (argc < 3) {
+    fprintf(stderr, "Usage : %s <fichier|-> <masque principal> [ping <port série>]\n", argv[0]);
+    return 1;
+  }
+  FILE *in = strcmp(argv[1], "-") ? fopen(argv[1], "rb") : stdin;
+  if (in == NULL) {
+    perror(argv[1]);
+    return 1;
+  }
+
+  uint8_t maskMain[MAIN_MASK_LENGTH];
+  parseMask(argv[2], maskMain, MAIN_MASK_LENGTH);
+
+  for (int i=3 ; i<argc ; i++) {
+    if (!strcmp(argv[i], "ping") && (i+1 < argc)) {
+      pingPort = fopen(argv[++i], "wb");
+      if (pingPort == NULL) {
+        perror(argv[i]);
+        return 1;
+      }
+    }
+  }
+
+  DECODER decoder(printField);
+  decoder.setMask(maskMain);
+
+  int c;
+  while ((c = fgetc(in)) != EOF) {
+    decoder.push(c);
+    if ((pingPort != NULL) && (c == FRAME_DELIMITER) && (hostMicros() - lastPing >= PING_INTERVAL)) sendPing();
+  }
+
+  fprintf(stderr, "%u paquets (%u d'un masque inconnu), %u trames rejetées, %u trames perdues\n",
+          decoder.packets, decoder.stale, decoder.errors, decoder.drops);
+  return 0;
+}
@@ -0,0 +1,184 @@
+// Capture brute des capteurs sur carte SD, à pleine cadence
+// Matthias Lemainque 2013
+
+#include "capture.h"
+
+// Un échantillon fait 28 octets une fois en trame, soit 2.8 ko/s à 100 Hz : la carte suit
+// sans peine, et les tampons de SDLOG absorbent ses pauses d'écriture. Les mesures brutes
+// permettent de rejouer et de régler le filtre hors ligne.
+
+CAPTURE::CAPTURE(SENSORS *newSensors, LOG *newLog) {
+  Sensors = newSensors;
+  Log = newLog;
+  nRecord = 0;
+  seq = 0;
+  ringTail = 0;
+  ringCount = 0;
+  burst = false;
+  postLeft = 0;
+  mode = CAPTURE_OFF;
+  records = 0;
+  drops = 0;
+  events = 0;
+  pre = CAPTURE_PRE;
+  post = CAPTURE_POST;
+  trigAcc = TRIGGER_ACC;
+  trigGyro = TRIGGER_GYRO;
+  trigInt = TRIGGER_INT;
+}
+
+// Un changement de mode en cours de capture garde le même fichier. Le fichier de télémétrie
+// est fermé avant la création du fichier brut : en cas d'échec, on en rouvre un
+boolean CAPTURE::start(uint8 newMode) {
+  if ((newMode != CAPTURE_CONTINUOUS) && (newMode != CAPTURE_TRIGGERED)) return false;
+  ringCount = 0;
+  burst = false;
+  postLeft = 0;
+  if (mode != CAPTURE_OFF) {
+    mode = newMode;
+    return true;
+  }
+  if (!(*Log).Sd.setup()) return false;
+  (*Log).sdTelemetry = false;
+  if (!(*Log).Sd.open(SD_PREFIX_RAW)) {
+    (*Log).Sd.open(SD_PREFIX_LOG);
+    (*Log).sdTelemetry = true;
+    return false;
+  }
+  seq = 0;
+  records = 0;
+  drops = 0;
+  events = 0;
+  mode = newMode;
+  return true;
+}
+
+void CAPTURE::stop() {
+  if (mode == CAPTURE_OFF) return;
+  mode = CAPTURE_OFF;
+  (*Log).Sd.open(SD_PREFIX_LOG);
+  (*Log).sdTelemetry = true;
+}
+
+
+//  * * * * * * * * * * * * *
+// E N R E G I S T R E M E N T S
+//  * * * * * * * * * * * * *
+
+void CAPTURE::put(uint32 value, uint8 n) {
+  for (int8 i=n-1 ; i>=0 ; i--) record[nRecord++] = value >> (8*i);
+}
+
+void CAPTURE::putFloat(float value) {
+  union { float f; uint32 u; } bits;
+  bits.f = value;
+  put(bits.u, 4);
+}
+
+void CAPTURE::writeRecord() {
+  uint8 frame[FRAME_LENGTH(CAPTURE_MAX_LENGTH)];
+  uint16 len = frameEncode(seq++, record, nRecord, frame);
+  for (uint16 i=0 ; i<len ; i++) (*Log).Sd.write(frame[i]);
+  nRecord = 0;
+  records++;
+}
+
+// Tout ce qu'il faut pour convertir les points bruts comme le fait SENSORS
+void CAPTURE::writeHeader() {
+  record[nRecord++] = CAPTURE_HEADER;
+  put(CAPTURE_VERSION, 1);
+  put((*Sensors).fixedDt ? (*Sensors).samplePeriod : 0, 4);
+  putFloat((*Sensors).rangeADXL345);
+  putFloat((*Sensors).rangeITG3200);
+  putFloat((*Sensors).rangeMAG3110);
+  for (uint8 i=0 ; i<3 ; i++) putFloat((*Sensors).zeroADXL345[i]);
+  for (uint8 i=0 ; i<3 ; i++) putFloat((*Sensors).zeroMAG3110[i]);
+  put((*Sensors).enableZeros, 1);
+  uint16 cal[BMP085_CAL_LENGTH];
+  (*Sensors).calibBMP085(cal);
+  for (uint8 i=0 ; i<BMP085_CAL_LENGTH ; i++) put(cal[i], 2);
+  put(ADXL_RATE_FULL, 1);
+  put(ITG_DIV_FULL, 1);
+  put(MAG_DR_FULL, 1);
+  writeRecord();
+}
+
+
+
+//  * * * * * * * * * * * * * * *
+// D E C L E N C H E M E N T
+//  * * * * * * * * * * * * * * *
+
+uint8 CAPTURE::trigger() {
+  uint8 cause = 0;
+  if ((trigAcc > 0) && (Norm2V((*Sensors).measureADXL345) > sq(trigAcc))) cause |= CAUSE_ACC;
+  if ((trigGyro > 0) && (Norm2V((*Sensors).measureITG3200) > sq(trigGyro))) cause |= CAUSE_GYRO;
+  if ((*Sensors).intADXL345 & trigInt) cause |= CAUSE_INT;
+  return cause;
+}
+
+// L'échantillon construit dans record entre dans la file ; si elle est pleine, le plus ancien
+// est perdu
+void CAPTURE::push() {
+  if (ringCount == CAPTURE_RING) {
+    pop(false);
+    drops++;
+  }
+  uint8 pos = (ringTail + ringCount) % CAPTURE_RING;
+  for (uint8 i=0 ; i<nRecord ; i++) ring[pos][i] = record[i];
+  ringLength[pos] = nRecord;
+  ringCount++;
+  nRecord = 0;
+}
+
+void CAPTURE::pop(boolean write) {
+  if (write) {
+    for (uint8 i=0 ; i<ringLength[ringTail] ; i++) record[i] = ring[ringTail][i];
+    nRecord = ringLength[ringTail];
+    writeRecord();
+  }
+  ringTail = (ringTail + 1) % CAPTURE_RING;
+  ringCount--;
+}
+
+void CAPTURE::loop() {
+  if ((mode == CAPTURE_OFF) || !(*Log).Sd.isOpen()) return;
+  if ((*Log).Sd.newFile) {
+    (*Log).Sd.newFile = false;
+    writeHeader();
+  }
+
+  uint8 type = CAPTURE_SAMPLE;
+  if ((*Sensors).rawBMP085 & RAW_BMP_UT) type = CAPTURE_SAMPLE_UT;
+  if ((*Sensors).rawBMP085 & RAW_BMP_UP) type = CAPTURE_SAMPLE_UP;
+  record[nRecord++] = type;
+  put((*Sensors).timeMeasure, 4);
+  for (uint8 i=0 ; i<3 ; i++) put((uint16)(*Sensors).rawADXL345[i], 2);
+  for (uint8 i=0 ; i<3 ; i++) put((uint16)(*Sensors).rawITG3200[i], 2);
+  for (uint8 i=0 ; i<3 ; i++) put((uint16)(*Sensors).rawMAG3110[i], 2);
+  if (type == CAPTURE_SAMPLE_UT) put((*Sensors).UT, 2);
+  if (type == CAPTURE_SAMPLE_UP) put((*Sensors).UP, 3);
+  push();
+
+  // En attente d'un événement : on ne garde que la fenêtre d'avant déclenchement
+  if ((mode == CAPTURE_TRIGGERED) && !burst) {
+    while (ringCount > pre) pop(false);
+    uint8 cause = trigger();
+    if (cause != 0) {
+      record[nRecord++] = CAPTURE_EVENT;
+      put((*Sensors).timeMeasure, 4);
+      put(cause, 1);
+      put((*Sensors).intADXL345, 1);
+      writeRecord();
+      events++;
+      burst = true;
+      postLeft = post;
+    }
+  }
+  else if (postLeft > 0) postLeft--;
+
+  if ((mode == CAPTURE_CONTINUOUS) || burst) {
+    for (uint8 i=0 ; (i<CAPTURE_DRAIN) && (ringCount > 0) ; i++) pop(true);
+    if ((postLeft == 0) && (ringCount == 0)) burst = false;
+  }
+}
@@ -0,0 +1,101 @@
+// Capture brute des capteurs sur carte SD, à pleine cadence
+// Matthias Lemainque 2013
+
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+#include "wirish.h"
+#include "maths.h"
+#include "framing.h"
+#include "sensors.h"
+#include "log.h"
+
+// Paramètres
+#define CAPTURE_VERSION		1
+#define CAPTURE_RING		96	// Echantillons gardés en RAM (0.96 s à 100 Hz)
+#define CAPTURE_DRAIN		4	// Enregistrements écrits au plus par échantillon, pour vider la file
+#define CAPTURE_PRE		50	// Echantillons conservés avant le déclenchement (au plus CAPTURE_RING-1 : en attente, la file n'est jamais pleine)
+#define CAPTURE_POST		150	// Echantillons enregistrés après le déclenchement
+#define TRIGGER_ACC		(1.8*9.81)	// Norme de l'accélération (m/s²), 0 : désactivé
+#define TRIGGER_GYRO		10	// Norme de la vitesse de rotation (rad/s), 0 : désactivé
+#define TRIGGER_INT		FREE_FALL	// Interruptions de l'ADXL345 (INT_SOURCE)
+
+// Constantes
+// Modes
+#define CAPTURE_OFF		0
+#define CAPTURE_CONTINUOUS	1	// Tous les échantillons
+#define CAPTURE_TRIGGERED	2	// Fenêtres autour des événements seulement
+
+// Origine d'un déclenchement
+#define CAUSE_ACC		(1<<0)
+#define CAUSE_GYRO		(1<<1)
+#define CAUSE_INT		(1<<2)
+
+// Chaque enregistrement est mis en trame comme la télémétrie (séquence, CRC-16, COBS) : la
+// séquence compte les enregistrements perdus. Entiers signés en poids fort d'abord.
+//   'H' en-tête, au début de chaque fichier :
+//       version (1), période d'échantillonnage (µs, 4), amplitudes ADXL345/ITG3200/MAG3110
+//       (float, 3x4), zéros ADXL345 puis MAG3110 (float, 6x4), zéros activés (1),
+//       étalonnage du BMP085 (BMP085_CAL_LENGTH x 2), ADXL_RATE_FULL, ITG_DIV_FULL, MAG_DR_FULL
+//   'S' échantillon : date (micros du top, 4), ADXL345, ITG3200, MAG3110 (3x2 chacun,
+//       points bruts dans les axes de chaque capteur)
+//   'T' échantillon suivi de UT (2) ; 'P' échantillon suivi de UP (3), lus pendant ce cycle
+//   'E' déclenchement : date (4), CAUSE_... (1), INT_SOURCE de l'ADXL345 (1) ; suivi des
+//       échantillons d'avant puis d'après l'événement
+#define CAPTURE_HEADER		'H'
+#define CAPTURE_SAMPLE		'S'
+#define CAPTURE_SAMPLE_UT	'T'
+#define CAPTURE_SAMPLE_UP	'P'
+#define CAPTURE_EVENT		'E'
+#define CAPTURE_MAX_LENGTH	(1 + 1 + 4 + 3*4 + 6*4 + 1 + BMP085_CAL_LENGTH*2 + 3)
+#define CAPTURE_SAMPLE_LENGTH	(1 + 4 + 3*3*2 + 3)
+
+// En déclenché, la file garde en permanence les CAPTURE_PRE derniers échantillons ; à
+// l'événement, elle est vidée sur la carte plus vite qu'elle ne se remplit, jusqu'à
+// CAPTURE_POST échantillons après lui. En continu, elle ne fait que passer les échantillons.
+class CAPTURE {
+private:
+  SENSORS *Sensors;
+  LOG *Log;
+
+  uint8 record[CAPTURE_MAX_LENGTH];
+  uint8 nRecord;
+  uint8 seq;
+
+  // File des échantillons en attente d'écriture
+  uint8 ring[CAPTURE_RING][CAPTURE_SAMPLE_LENGTH];
+  uint8 ringLength[CAPTURE_RING];
+  uint8 ringTail, ringCount;
+  void push();
+  void pop(boolean write);
+
+  boolean burst;	// Déclenchement en cours : la file est vidée sur la carte
+  uint16 postLeft;	// Echantillons restant à prendre après le déclenchement
+  uint8 trigger();	// CAUSE_... réunies par le dernier échantillon
+
+  void put(uint32 value, uint8 n);	// n octets, poids fort d'abord
+  void putFloat(float value);
+  void writeRecord();
+  void writeHeader();
+
+public:
+  CAPTURE(SENSORS *newSensors, LOG *newLog);
+
+  boolean start(uint8 newMode);	// Ouvre un fichier RAW_xxx.BIN : la télémétrie n'est plus copiée sur la carte
+  void stop();			// Revient à un fichier LOG_xxx.BIN
+  void loop();			// Après chaque lecture des capteurs
+
+  uint8 mode;
+  uint32 records;
+  uint32 drops;		// Echantillons perdus, la file étant pleine
+  uint32 events;
+
+  // Déclenchement
+  uint8 pre;
+  uint16 post;
+  float trigAcc;	// m/s²
+  float trigGyro;	// rad/s
+  uint8 trigInt;
+};
+
+#endif // _CAPTURE_H_
@@ -0,0 +1,262 @@
+// Réception et exécution des commandes de l'ordinateur client
+// Matthias Lemainque 2013
+
+#include "command.h"
+
+COMMAND::COMMAND(LOG *newLog, KALMAN *newKalman, CALIB *newCalib, SCHEDULER *newScheduler, FLASH *newFlash, CAPTURE *newCapture) {
+  Log = newLog;
+  Kalman = newKalman;
+  Calib = newCalib;
+  Scheduler = newScheduler;
+  Flash = newFlash;
+  Capture = newCapture;
+  nFrame = 0;
+  overflow = false;
+  rxTime = 0;
+  nCommands = 0;
+  errors = 0;
+}
+
+// Fronts descendants de RX (sous interruption) : un front suivant un silence de plus de
+// RX_IDLE est le bit de start du premier octet d'une rafale
+static volatile uint32 rxEdge = 0;
+static volatile uint32 rxBurst = 0;
+static void rxFalling() {
+  uint32 now = micros();
+  if (now - rxEdge > RX_IDLE) rxBurst = now;
+  rxEdge = now;
+}
+
+void COMMAND::setup() {
+  attachInterrupt(PIN_SERIAL_RX, rxFalling, FALLING);
+}
+
+
+//  * * * * * * * * *
+// R E C E P T I O N
+//  * * * * * * * * *
+
+void COMMAND::loop() {
+  while (Serial.available()) {
+    uint8 c = Serial.read();
+    if (c != FRAME_DELIMITER) {
+      if (nFrame == 0) rxTime = rxBurst;
+      if (nFrame < CMD_FRAME_LENGTH) frame[nFrame++] = c;
+      else overflow = true;
+      continue;
+    }
+
+    // Fin de trame : COBS, puis séquence | commande | arguments | CRC
+    uint8 cmd[CMD_FRAME_LENGTH];
+    uint8 n = (nFrame > 0) && !overflow ? cobsDecode(frame, nFrame, cmd) : 0;
+    if (n > 0) {
+      if ((n < FRAME_HEADER + 1 + FRAME_CRC) || (crc16(cmd, n) != 0)) n = 0;
+    }
+    if (n > 0) execute(cmd, n - FRAME_CRC);
+    else if ((nFrame > 0) || overflow) errors++;
+    nFrame = 0;
+    overflow = false;
+  }
+}
+
+
+//  * * * * * * * * *
+// E X E C U T I O N
+//  * * * * * * * * *
+
+// cmd : séquence, commande, arguments (n octets, CRC retiré)
+void COMMAND::execute(uint8 *cmd, uint8 n) {
+  uint8 seq = cmd[0];
+  uint8 *arg = cmd + FRAME_HEADER + 1;
+  uint8 nArg = n - FRAME_HEADER - 1;
+  uint8 status = ACK_OK;
+  uint32 value;
+
+  nCommands++;
+  (*Log).lastCommand = millis();
+  switch (cmd[FRAME_HEADER]) {
+
+  case CMD_PING : // Date du client, poids forts en tête
+    if (nArg != 4) { status = ACK_INVALID; break; }
+    value = ((uint32)arg[0] << 24) | ((uint32)arg[1] << 16) | ((uint32)arg[2] << 8) | arg[3];
+    (*Log).reply(MASK_ECHO, value, rxTime);
+    break;
+
+  case CMD_MASK :
+    status = setMask(arg, nArg);
+    break;
+
+  case CMD_MASK_GET :
+    status = getMask(arg, nArg);
+    break;
+
+  case CMD_SAVE :
+    status = saveMasks();
+    break;
+
+  case CMD_PARAM_SET :
+    if (nArg != 5) { status = ACK_INVALID; break; }
+    value = ((uint32)arg[1] << 24) | ((uint32)arg[2] << 16) | ((uint32)arg[3] << 8) | arg[4];
+    status = setParam(arg[0], value);
+    if (status != ACK_OK) break;
+    // Pas de break : la valeur retenue est renvoyée comme pour une lecture
+  case CMD_PARAM_GET :
+    if (nArg < 1) { status = ACK_INVALID; break; }
+    if (getParam(arg[0], &value)) (*Log).reply(MASK_PARAM, arg[0], value);
+    else status = ACK_UNKNOWN;
+    break;
+
+  case CMD_CALIB :
+    if ((*Calib).state == CALIB_OFF) (*Calib).state = CALIB_WAIT;
+    else status = ACK_BUSY;
+    break;
+
+  case CMD_PERF :
+    sendPerf();
+    break;
+
+  case CMD_SD_CLOSE : // Précède une coupure d'alimentation : on sauvegarde aussi l'état du filtre
+    (*Kalman).save(true);
+    if ((*Log).Sd.isOpen()) (*Log).Sd.close();
+    else status = ACK_BUSY;
+    break;
+
+  case CMD_CAPTURE :
+    if ((nArg != 1) || (arg[0] > CAPTURE_TRIGGERED)) status = ACK_INVALID;
+    else if (arg[0] == CAPTURE_OFF) (*Capture).stop();
+    else if (!(*Capture).start(arg[0])) status = ACK_BUSY;
+    break;
+
+  default :
+    status = ACK_UNKNOWN;
+  }
+  (*Log).reply(MASK_ACK, seq, status);
+}
+
+// arg : 0 (principal) ou 1 (auxiliaire), puis les codes des champs. Le masque principal doit
+// tenir dans le débit de la liaison (SLOT_LENGTH) ; chaque champ auxiliaire dans lenAux. Le
+// masque principal est annoncé au client avant d'être appliqué (cf. framing.h).
+uint8 COMMAND::setMask(uint8 *arg, uint8 n) {
+  if (n < 1) return ACK_INVALID;
+  uint8 length = (arg[0] == 0) ? MAIN_MASK_LENGTH : AUX_MASK_LENGTH;
+  if ((arg[0] > 1) || (n-1 > length)) return ACK_INVALID;
+  uint8 codes[AUX_MASK_LENGTH];
+  for (uint8 i=0 ; i<length ; i++) {
+    codes[i] = (i < n-1) ? arg[i+1] : MASK_END;
+    if ((i < n-1) && ((tmLength(codes[i]) == 0) || (codes[i] >= TM_FIRST_REPLY))) return ACK_INVALID;
+    if ((arg[0] == 1) && (i < n-1) && (1 + tmLength(codes[i]) > (*Log).lenAux)) return ACK_INVALID;
+  }
+  if (arg[0] == 0) {
+    if ((*Log).mainLength(codes) > SLOT_LENGTH) return ACK_INVALID;
+    return (*Log).setMain(codes, (*Log).deltaNext) ? ACK_OK : ACK_BUSY;
+  }
+  (*Log).setAux(codes);
+  return ACK_OK;
+}
+
+// arg : 0 (principal) ou 1 (auxiliaire) ; le masque est renvoyé par mots de 4 codes
+uint8 COMMAND::getMask(uint8 *arg, uint8 n) {
+  if ((n != 1) || (arg[0] > 1)) return ACK_INVALID;
+  uint8 id = (arg[0] == 0) ? PARAM_MASK_MAIN : PARAM_MASK_AUX;
+  uint8 length = (arg[0] == 0) ? MAIN_MASK_LENGTH : AUX_MASK_LENGTH;
+  uint32 value;
+  for (uint8 i=0 ; i<TM_MASK_WORDS(length) ; i++) {
+    getParam(id+i, &value);
+    (*Log).reply(MASK_PARAM, id+i, value);
+  }
+  return ACK_OK;
+}
+
+// Une seule écriture de la page ; le filtre peut manquer une échéance pendant l'effacement
+uint8 COMMAND::saveMasks() {
+  (*Flash).writeT8((*Log).maskNext, FLASH_MAIN_MASK, MAIN_MASK_LENGTH/2, false);
+  (*Flash).writeT8((*Log).maskAux, FLASH_AUX_MASK, AUX_MASK_LENGTH/2, false);
+  (*Flash).write(FLASH_AUX_LENGTH, (*Log).lenAux, false);
+  return (*Flash).write(FLASH_MASK_VALID, FLASH_MASK_MAGIC) ? ACK_OK : ACK_BUSY;
+}
+
+uint8 COMMAND::setParam(uint8 id, uint32 value) {
+  if (id == PARAM_FILTER) {
+    if ((value != FILTER_KALMAN) && (value != FILTER_MAHONY)) return ACK_INVALID;
+    (*Kalman).setMode(value);
+    return ACK_OK;
+  }
+  if (id == PARAM_DELTA) {
+    return (*Log).setMain((*Log).maskNext, value != 0) ? ACK_OK : ACK_BUSY;
+  }
+  if (id == PARAM_LEN_AUX) {
+    if ((value > AUX_MAX_LENGTH) || ((*Log).mainLength((*Log).maskNext) + value > SLOT_LENGTH)) return ACK_INVALID;
+    (*Log).lenAux = value;
+    return ACK_OK;
+  }
+  if (id == PARAM_CAPTURE_PRE) {
+    if ((value < 1) || (value > CAPTURE_RING-1)) return ACK_INVALID;
+    (*Capture).pre = value;
+    return ACK_OK;
+  }
+  if (id == PARAM_CAPTURE_POST) {
+    if (value > 0xFFFF) return ACK_INVALID;
+    (*Capture).post = value;
+    return ACK_OK;
+  }
+  if (id == PARAM_TRIGGER_ACC) {
+    (*Capture).trigAcc = value * 9.81e-3;
+    return ACK_OK;
+  }
+  if (id == PARAM_TRIGGER_GYRO) {
+    (*Capture).trigGyro = value / CDR;
+    return ACK_OK;
+  }
+  if (id == PARAM_TRIGGER_INT) {
+    if (value > 0xFF) return ACK_INVALID;
+    (*Capture).trigInt = value;
+    return ACK_OK;
+  }
+  uint8 code = id & 0x3F;
+  if ((code >= TM_FIRST_REPLY) || (id < PARAM_RATE_AUX)) return ACK_UNKNOWN;
+  if ((id >= PARAM_END) || (value > 0xFF)) return ACK_INVALID;
+  if (id < PARAM_PRIORITY_AUX) (*Log).rateAux[code] = value;
+  else (*Log).priorityAux[code] = value;
+  return ACK_OK;
+}
+
+boolean COMMAND::getParam(uint8 id, uint32 *value) {
+  uint8 code = id & 0x3F;
+  if (id == PARAM_FILTER) *value = (*Kalman).mode;
+  else if (id == PARAM_DELTA) *value = (*Log).deltaNext;
+  else if (id == PARAM_LEN_AUX) *value = (*Log).lenAux;
+  else if (id == PARAM_CAPTURE_PRE) *value = (*Capture).pre;
+  else if (id == PARAM_CAPTURE_POST) *value = (*Capture).post;
+  else if (id == PARAM_TRIGGER_ACC) *value = (*Capture).trigAcc / 9.81e-3 + 0.5;
+  else if (id == PARAM_TRIGGER_GYRO) *value = (*Capture).trigGyro * CDR + 0.5;
+  else if (id == PARAM_TRIGGER_INT) *value = (*Capture).trigInt;
+  else if (id == PARAM_MASK_GEN) *value = (*Log).genNext;
+  else if (id == PARAM_TX_DROPS) *value = (*Log).txDrops;
+  else if (id == PARAM_SD_OVERRUNS) *value = (*Log).Sd.overruns;
+  else if (id == PARAM_CMD_ERRORS) *value = errors;
+  else if (id == PARAM_CAPTURE_DROPS) *value = (*Capture).drops;
+  else if ((id >= PARAM_MASK_MAIN) && (id < PARAM_MASK_MAIN + TM_MASK_WORDS(MAIN_MASK_LENGTH)))
+    *value = tmMaskWord((*Log).maskNext, MAIN_MASK_LENGTH, id - PARAM_MASK_MAIN);
+  else if ((id >= PARAM_MASK_AUX) && (id < PARAM_MASK_AUX + TM_MASK_WORDS(AUX_MASK_LENGTH)))
+    *value = tmMaskWord((*Log).maskAux, AUX_MASK_LENGTH, id - PARAM_MASK_AUX);
+  else if ((id < PARAM_RATE_AUX) || (id >= PARAM_END) || (code >= TM_FIRST_REPLY)) return false;
+  else if (id < PARAM_PRIORITY_AUX) *value = (*Log).rateAux[code];
+  else *value = (*Log).priorityAux[code];
+  return true;
+}
+
+// Une réponse par zone de code, une par tâche, puis le taux d'occupation (‰) : la file de
+// LOG les étale sur les paquets suivants. Les compteurs saturent à 24 bits.
+void COMMAND::sendPerf() {
+  uint32 n, cMin, cAvg, cMax;
+  for (uint8 i=0 ; i<PROFILE_ZONES ; i++) {
+    profileStats(i, &n, &cMin, &cAvg, &cMax);
+    (*Log).reply(MASK_PERF, ((uint32)i << 24) | min(n, 0xFFFFFF), cMin, cAvg, cMax);
+  }
+  uint32 over, jAvg, jMax, share;
+  for (uint8 i=0 ; (*Scheduler).taskStats(i, &over, &jAvg, &jMax, &share) ; i++)
+    (*Log).reply(MASK_PERF, ((uint32)(PERF_TASK + i) << 24) | min(over, 0xFFFFFF), jAvg, jMax, share);
+  (*Log).reply(MASK_PERF, (uint32)PERF_DUTY << 24, 0, 1000 * (*Scheduler).dutyCycle(), 0);
+  profileReset();
+  (*Scheduler).resetStats();
+}
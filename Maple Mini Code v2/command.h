@@ -0,0 +1,63 @@
+// Réception et exécution des commandes de l'ordinateur client
+// Matthias Lemainque 2013
+
+#ifndef _COMMAND_H_
+#define _COMMAND_H_
+
+#include "wirish.h"
+#include "store.h"
+#include "framing.h"
+#include "telemetry.h"
+#include "kalman.h"
+#include "calib.h"
+#include "log.h"
+#include "capture.h"
+#include "scheduler.h"
+#include "profile.h"
+
+// Paramètres
+#define CMD_MAX_LENGTH		32	// Commande et arguments, hors séquence et CRC
+
+// Constantes
+#define CMD_FRAME_LENGTH	FRAME_LENGTH(CMD_MAX_LENGTH)
+#define RX_IDLE			(2*10*1000000/BAUD_RATE)	// Silence (µs) séparant deux rafales sur RX
+
+// Les octets sont reçus sous interruption par la libmaple dans le tampon circulaire de
+// l'USART : loop() ne fait que le vider sans jamais attendre, et exécute chaque trame
+// complète. La télémétrie continue donc pendant que le client parle.
+// La date de réception ne peut être prise à la lecture (jusqu'à CMD_PERIOD de retard) : une
+// interruption sur les fronts descendants de RX date le bit de start de chaque rafale, et une
+// trame commençant une rafale (cas du ping, envoyé seul) en reçoit la date.
+class COMMAND {
+private:
+  LOG *Log;
+  KALMAN *Kalman;
+  CALIB *Calib;
+  SCHEDULER *Scheduler;
+  FLASH *Flash;
+  CAPTURE *Capture;
+
+  uint8 frame[CMD_FRAME_LENGTH];
+  uint8 nFrame;
+  boolean overflow;	// Trame trop longue : ignorée jusqu'au prochain délimiteur
+  uint32 rxTime;	// Date (micros) du début de la rafale contenant le premier octet de la trame
+
+  void execute(uint8 *cmd, uint8 n);
+  uint8 setMask(uint8 *arg, uint8 n);
+  uint8 getMask(uint8 *arg, uint8 n);
+  uint8 saveMasks();
+  uint8 setParam(uint8 id, uint32 value);
+  boolean getParam(uint8 id, uint32 *value);
+  void sendPerf();
+
+public:
+  COMMAND(LOG *newLog, KALMAN *newKalman, CALIB *newCalib, SCHEDULER *newScheduler, FLASH *newFlash, CAPTURE *newCapture);
+
+  void setup();
+  void loop();
+
+  uint32 nCommands;
+  uint32 errors;	// Trames rejetées (COBS, CRC ou longueur)
+};
+
+#endif // _COMMAND_H_
@@ -0,0 +1,89 @@
+// Approximations rapides des fonctions de libm utilisées dans la boucle principale
+// Matthias Lemainque 2013
+
+#include "fastmath.h"
+
+// Permet de manipuler la représentation IEEE754 d'un flottant
+union FLOAT_BITS {
+  float f;
+  uint32 i;
+};
+
+
+// * * * * * * * * * * * * *
+//  R A C I N E   C A R R E E
+// * * * * * * * * * * * * *
+
+// Estimation initiale par manipulation de l'exposant, puis deux itérations de Newton
+// (erreur relative de 1.8e-3 après une itération, 5e-6 après deux)
+float fastInvSqrt(float x) {
+  FLOAT_BITS u;
+  u.f = x;
+  u.i = 0x5F3759DF - (u.i >> 1);
+  float half = x / 2;
+  u.f = u.f * (1.5f - half * u.f * u.f);
+  u.f = u.f * (1.5f - half * u.f * u.f);
+  return u.f;
+}
+
+float fastSqrt(float x) {
+  if (x <= 0) return 0;
+  return x * fastInvSqrt(x);
+}
+
+
+// * * * * * * * * * * * * * * * *
+//  T R I G O N O M E T R I E
+// * * * * * * * * * * * * * * * *
+
+// Polynôme minimax de degré 9 de atan(z) pour |z| <= 1, puis réduction par symétries
+float fastAtan2(float y, float x) {
+  float ax = abs(x);
+  float ay = abs(y);
+  if ((ax == 0) && (ay == 0)) return 0;
+
+  boolean swap = (ay > ax);
+  float z = swap ? ax/ay : ay/ax;
+  float z2 = z*z;
+  float a = z * (0.9998660f + z2*(-0.3302995f + z2*(0.1801410f + z2*(-0.0851330f + z2*0.0208351f))));
+
+  if (swap) a = HALF_PI - a;
+  if (x < 0) a = PI - a;
+  if (y < 0) a = -a;
+  return a;
+}
+
+// asin(x) = atan2(x, sqrt(1-x²))
+float fastAsin(float x) {
+  x = constrain(x, -1, 1);
+  return fastAtan2(x, fastSqrt(1 - x*x));
+}
+
+
+// * * * * * * * * * * * * * * * * * *
+//  F O R M U L E   B A R O M E T R I Q U E
+// * * * * * * * * * * * * * * * * * *
+
+// r^a = 2^(a.log2(r)) ; log2 et 2^x sont obtenus en séparant exposant et mantisse,
+// puis par des polynômes (moindres carrés) sur [1,2[ et [0,1[ :
+//   log2(1+t) : erreur < 2.2e-6 , 2^f : erreur relative < 1.1e-7
+float fastPowBaro(float r) {
+  if (r <= 0) return 0;
+
+  // log2(r)
+  FLOAT_BITS u;
+  u.f = r;
+  int32 e = (int32)((u.i >> 23) & 0xFF) - 127;
+  u.i = (u.i & 0x007FFFFF) | 0x3F800000; // Mantisse dans [1,2[
+  float t = u.f - 1;
+  float l = e + (2.1237396e-6f + t*(1.4424753f + t*(-0.7175579f + t*(0.4555271f + t*(-0.2746233f + t*(0.1192982f + t*-0.0251232f))))));
+
+  // 2^(l/5.255)
+  float y = l / 5.255f;
+  int32 n = (int32)y;
+  if (y < n) n--; // Partie entière par défaut
+  float f = y - n;
+  u.f = 0.9999999f + f*(0.6931546f + f*(0.2401408f + f*(0.0558633f + f*(0.0089462f + f*0.0018951f))));
+  u.i += (uint32)n << 23; // Multiplication par 2^n
+  return u.f;
+}
@@ -0,0 +1,32 @@
+// Approximations rapides des fonctions de libm utilisées dans la boucle principale
+// Matthias Lemainque 2013
+
+#ifndef _FASTMATH_H_
+#define _FASTMATH_H_
+
+#if defined(__arm__)
+#include "wirish.h"
+#else
+// Sur l'ordinateur (banc d'essai de Host decoder/) : équivalents des types et macros de wirish
+#include <stdint.h>
+#include <cmath>
+using std::abs;
+typedef uint32_t uint32;
+typedef int32_t int32;
+typedef bool boolean;
+#define PI		3.1415926535897932384626433832795
+#define HALF_PI		1.5707963267948966192313216916398
+#define constrain(amt,low,high)	((amt)<(low)?(low):((amt)>(high)?(high):(amt)))
+#endif
+
+// Le Cortex-M3 n'a pas d'unité flottante : chaque appel à atan2, asin, sqrt ou pow de libm
+// coûte plusieurs milliers de cycles. Les erreurs maximales indiquées sont vérifiées sur
+// l'ensemble du domaine, par comparaison à libm, par Host decoder/fastmath_test.cpp.
+
+float fastInvSqrt(float x);		// 1/sqrt(x) : erreur relative < 5e-6 (x > 0)
+float fastSqrt(float x);		// sqrt(x)   : erreur relative < 5e-6, renvoie 0 si x <= 0
+float fastAtan2(float y, float x);	// atan2     : erreur < 1.2e-5 rad
+float fastAsin(float x);		// asin      : erreur < 2e-5 rad (x est borné à [-1,1])
+float fastPowBaro(float r);		// r^(1/5.255) de la formule barométrique : erreur relative < 1e-6 pour r dans [0.05,20]
+
+#endif // _FASTMATH_H_
@@ -0,0 +1,141 @@
+// Mise en trame des paquets : numéro de séquence, CRC-16 et bourrage COBS
+// Partagé tel quel par le micrologiciel et le décodeur du client (Host decoder/)
+// Matthias Lemainque 2013
+
+#ifndef _FRAMING_H_
+#define _FRAMING_H_
+
+#include <stdint.h>
+
+// Une trame est : COBS( séquence | paquet | CRC-16 ) puis FRAME_DELIMITER.
+// Le bourrage COBS (Consistent Overhead Byte Stuffing) retire tous les zéros de la trame,
+// pour 1 octet de surcoût par tranche de 254 : le récepteur se recale au prochain zéro quel
+// que soit l'octet perdu ou corrompu, et le numéro de séquence compte les trames perdues.
+#define FRAME_DELIMITER		0x00
+#define FRAME_HEADER		1	// Numéro de séquence
+#define FRAME_CRC		2
+#define FRAME_LENGTH(n)		((n) + FRAME_HEADER + FRAME_CRC + ((n)+FRAME_HEADER+FRAME_CRC)/254 + 2)	// Pire cas, délimiteur compris
+
+// CRC-16/CCITT (polynôme 0x1021, initialisé à 0xFFFF), calculé par quartets
+inline uint16_t crc16(const uint8_t *data, uint16_t n) {
+  static const uint16_t table[16] = {
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+    0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF };
+  uint16_t crc = 0xFFFF;
+  for (uint16_t i=0 ; i<n ; i++) {
+    crc = (crc << 4) ^ table[(crc >> 12) ^ (data[i] >> 4)];
+    crc = (crc << 4) ^ table[(crc >> 12) ^ (data[i] & 0x0F)];
+  }
+  return crc;
+}
+
+// Chaque bloc commence par un octet donnant la distance au prochain zéro (supprimé) ;
+// 0xFF signale un bloc de 254 octets non nuls sans zéro à sa suite. Renvoit la longueur
+// écrite dans out, délimiteur non compris.
+inline uint16_t cobsEncode(const uint8_t *in, uint16_t n, uint8_t *out) {
+  uint16_t len = 1;
+  uint16_t posCode = 0;
+  uint8_t code = 1;
+  for (uint16_t i=0 ; i<n ; i++) {
+    if (in[i] != 0) {
+      out[len++] = in[i];
+      code++;
+    }
+    if ((in[i] == 0) || (code == 0xFF)) {
+      out[posCode] = code;
+      code = 1;
+      posCode = len++;
+    }
+  }
+  out[posCode] = code;
+  return len;
+}
+
+// Opération inverse, délimiteur exclu. Renvoit la longueur décodée, 0 si la trame est invalide.
+inline uint16_t cobsDecode(const uint8_t *in, uint16_t n, uint8_t *out) {
+  uint16_t len = 0;
+  uint16_t i = 0;
+  while (i < n) {
+    uint8_t code = in[i++];
+    if ((code == 0) || (i + code - 1 > n)) return 0;
+    for (uint8_t j=1 ; j<code ; j++) out[len++] = in[i++];
+    if ((code != 0xFF) && (i < n)) out[len++] = 0;
+  }
+  return len;
+}
+
+// Construit la trame complète de n octets de données, délimiteur compris ; out doit pouvoir
+// contenir FRAME_LENGTH(n) octets. Renvoit la longueur de la trame.
+inline uint16_t frameEncode(uint8_t seq, const uint8_t *data, uint16_t n, uint8_t *out) {
+  uint8_t packet[FRAME_HEADER + 255 + FRAME_CRC];
+  packet[0] = seq;
+  for (uint16_t i=0 ; i<n ; i++) packet[FRAME_HEADER+i] = data[i];
+  uint16_t crc = crc16(packet, FRAME_HEADER+n);
+  packet[FRAME_HEADER+n] = crc >> 8;
+  packet[FRAME_HEADER+n+1] = crc & 0xFF;
+  uint16_t len = cobsEncode(packet, FRAME_HEADER+n+FRAME_CRC, out);
+  out[len++] = FRAME_DELIMITER;
+  return len;
+}
+
+
+// * * * * * * * * * * * * * * * * * *
+//  C O M M A N D E S   D U   C L I E N T
+// * * * * * * * * * * * * * * * * * *
+
+// Les commandes voyagent dans des trames identiques : séquence | commande | arguments.
+// Chacune reçoit en retour, dans la télémétrie, un champ ACK (séquence, état).
+#define CMD_PING		'T'	// Date du client (4 octets) -> ECHO
+#define CMD_MASK		'M'	// Masque (0 : principal, 1 : auxiliaire), puis ses codes
+#define CMD_MASK_GET		'm'	// Masque (0 ou 1) -> PARAM pour chaque mot PARAM_MASK_...
+#define CMD_SAVE		'W'	// Enregistre les masques et lenAux en flash (lus au démarrage)
+#define CMD_PARAM_SET		'P'	// Identifiant PARAM_... (1 octet), valeur (4 octets) -> PARAM
+#define CMD_PARAM_GET		'G'	// Identifiant PARAM_... (1 octet) -> PARAM
+#define CMD_CALIB		'C'	// Lance la calibration des capteurs
+#define CMD_PERF		'D'	// Statistiques des zones de code et de l'ordonnanceur -> PERF par zone, puis remise à zéro
+#define CMD_SD_CLOSE		'F'	// Ferme le fichier SD (mise à jour de sa taille) avant de couper l'alimentation
+#define CMD_CAPTURE		'R'	// Capture brute des capteurs sur la carte SD (CAPTURE_...), 0 : retour à la télémétrie
+
+// Paramètres accessibles par CMD_PARAM_...
+#define PARAM_FILTER		0x00	// Estimateur : FILTER_KALMAN ou FILTER_MAHONY
+#define PARAM_DELTA		0x01	// Codage différentiel du paquet principal
+#define PARAM_LEN_AUX		0x02	// Taille maxi du paquet auxiliaire (octets)
+#define PARAM_CAPTURE_PRE	0x03	// Echantillons conservés avant un déclenchement (1 à CAPTURE_RING-1)
+#define PARAM_CAPTURE_POST	0x04	// Echantillons enregistrés après un déclenchement
+#define PARAM_TRIGGER_ACC	0x05	// Seuil sur la norme de l'accélération (mg), 0 : désactivé
+#define PARAM_TRIGGER_GYRO	0x06	// Seuil sur la norme de la vitesse de rotation (°/s), 0 : désactivé
+#define PARAM_TRIGGER_INT	0x07	// Interruptions de l'ADXL345 déclenchant la capture (INT_SOURCE)
+#define PARAM_MASK_GEN		0x08	// Génération du masque principal, modulo 16 (lecture seule)
+#define PARAM_TX_DROPS		0x09	// Trames abandonnées, tampon d'émission série plein (lecture seule)
+#define PARAM_SD_OVERRUNS	0x0A	// Octets perdus sur la carte SD, tous les tampons étant pleins (lecture seule)
+#define PARAM_CMD_ERRORS	0x0B	// Trames de commande rejetées : COBS, CRC ou longueur (lecture seule)
+#define PARAM_CAPTURE_DROPS	0x0C	// Echantillons de capture brute perdus, file pleine (lecture seule)
+#define PARAM_MASK_MAIN		0x10	// + mot : 4 codes du masque principal, le premier en poids fort (lecture seule)
+#define PARAM_MASK_AUX		0x20	// + mot : 4 codes du masque auxiliaire (lecture seule)
+#define PARAM_RATE_AUX		0x40	// + code : fréquence visée (Hz) du champ dans le paquet auxiliaire
+#define PARAM_PRIORITY_AUX	0x80	// + code : priorité du champ dans le paquet auxiliaire
+#define PARAM_END		0xC0	// Premier identifiant non attribué
+
+// Un changement du masque principal ou du codage (CMD_MASK 0, PARAM_DELTA) est annoncé dans
+// la télémétrie par des réponses PARAM : les mots PARAM_MASK_MAIN, PARAM_DELTA, puis
+// PARAM_MASK_GEN en dernier. La Maple n'applique le nouveau masque qu'au paquet suivant celui
+// qui porte PARAM_MASK_GEN, et chaque paquet porte dans son en-tête la génération du masque
+// qui l'a construit (cf. telemetry.h) : le décodeur du client change de masque en voyant la
+// génération annoncée, et reconnaît les paquets d'un masque qu'il n'a pas reçu. L'annonce du
+// masque en vigueur est répétée toutes les ANNOUNCE_INTERVAL ms : un décodeur qui en a perdu
+// une retrouve le masque sans rien demander (lecture d'un fichier). Un second changement est
+// refusé (ACK_BUSY) tant que l'annonce du premier n'est pas partie.
+
+// Etat renvoyé dans ACK
+#define ACK_OK			0
+#define ACK_UNKNOWN		1	// Commande ou paramètre inconnu
+#define ACK_INVALID		2	// Arguments invalides
+#define ACK_BUSY		3	// Refusée dans l'état actuel
+
+// Zones de PERF hors profile.h. Pour une tâche de l'ordonnanceur, la première valeur porte le
+// nombre de dépassements d'échéance au lieu du nombre de mesures, suivi de la gigue moyenne
+// et maxi (µs) et de la part du temps processeur (‰)
+#define PERF_TASK		0x80	// + identifiant de la tâche
+#define PERF_DUTY		0xFF	// Taux d'occupation de l'ordonnanceur (‰, dans la valeur moyenne)
+
+#endif // _FRAMING_H_
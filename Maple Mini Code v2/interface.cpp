@@ -51,15 +51,22 @@ void INTERFACE::clearLcd() {
 }
 
 void INTERFACE::actuLcd() {
-  (*Lcd).printFLoc((*Kalman).Cardan[0], 4,  1, 4); // Lacet
-  (*Lcd).printFLoc((*Kalman).Cardan[1], 8,  1, 3); // Roulis
-  (*Lcd).printFLoc((*Kalman).Cardan[2], 12, 1, 3); // Tangage
-
-  (*Lcd).printFLoc(NormV((*Kalman).measureADXL345_0), 4,  2, 4); // Accélération
-  (*Lcd).printFLoc(NormV((*Kalman).measureMAG3110_0), 10, 2, 4); // Champ magnétique
-
-  (*Lcd).printFLoc((*Sensors).temperature, 3, 3, 3); // Température
-  (*Lcd).printFLoc((*Sensors).altitude(), 10, 3, 5); // Altitude
+  SNAPSHOT snap;
+  (*Kalman).read(&snap);
+
+  // Orientation extrapolée à l'instant de l'affichage
+  float Q[4], Cardan[3];
+  snap.predictAt(Q, micros());
+  CalcCardan(Cardan, Q);
+  (*Lcd).printFLoc(Cardan[0], 4,  1, 4); // Lacet
+  (*Lcd).printFLoc(Cardan[1], 8,  1, 3); // Roulis
+  (*Lcd).printFLoc(Cardan[2], 12, 1, 3); // Tangage
+
+  (*Lcd).printFLoc(NormV(snap.getADXL345_0()), 4,  2, 4); // Accélération
+  (*Lcd).printFLoc(NormV(snap.getMAG3110_0()), 10, 2, 4); // Champ magnétique
+
+  (*Lcd).printFLoc(snap.temperature, 3, 3, 3); // Température
+  (*Lcd).printFLoc(snap.getAltitude(), 10, 3, 5); // Altitude
 }
 
 void INTERFACE::underlineBmp(uint8 *bmp, uint8 width) {
@@ -75,15 +82,15 @@ void INTERFACE::actuLcdParam() {
     0x00, 0x2E, 0x2A, 0x2A, 0x3A, 0x00, 0x00, 0x3E, 0x22, 0x22, 0x1C, 0x00 };
   (*Lcd).setCursor(1, 5);
   (*Lcd).negative = (cursor_pos == 0);
-  if ((*Log).file.isOpen()) underlineBmp(bmp, 12);
+  if ((*Log).Sd.isOpen()) underlineBmp(bmp, 12);
   (*Lcd).bitmap(bmp, 1, 12);
   
-  // Activation de la fonction Listen
+  // Liaison avec l'ordinateur client (commande reçue récemment)
   bmp[12] = {
     0x00, 0x2E, 0x2A, 0x2A, 0x3A, 0x00, 0x00, 0x3E, 0x22, 0x22, 0x1C, 0x00 };
   (*Lcd).setCursor(4, 5);
   (*Lcd).negative = (cursor_pos == 1);
-  if ((*Log).enableListen) underlineBmp(bmp, 12);
+  if ((*Log).isLinked()) underlineBmp(bmp, 12);
   (*Lcd).bitmap(bmp, 1, 12);
 
   // Inhibition des capteurs ADXL345 & MAG3110
@@ -91,7 +98,6 @@ void INTERFACE::actuLcdParam() {
     0x00, 0x18, 0x3C, 0x7E, 0x42, 0x42, 0x52, 0x52, 0x76, 0x36, 0x24, 0x00 };
   (*Lcd).setCursor(4, 5);
   (*Lcd).negative = (cursor_pos == 1);
-  if ((*Log).enableListen) underlineBmp(bmp, 12);
   (*Lcd).bitmap(bmp, 1, 12);
   
   // Calibration des capteurs
@@ -147,15 +153,13 @@ void INTERFACE::actuLcdCalib() {
   }
 }
 
+// Appelée par l'ordonnanceur toutes les LCD_PERIOD ms
 void INTERFACE::loop() {
-  if (millis()-lastLcd > 100) {
-    lastLcd = millis();
-    if ((*Calib).state == CALIB_OFF) {
-      if (lastLcdCalib) clearLcd();
-      actuLcd();
-    }
-    else actuLcdCalib();
+  if ((*Calib).state == CALIB_OFF) {
+    if (lastLcdCalib) clearLcd();
+    actuLcd();
   }
+  else actuLcdCalib();
 }
 
 void INTERFACE::pause() {
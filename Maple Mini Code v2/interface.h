@@ -11,6 +11,9 @@
 #include "calib.h"
 #include "pcd8544.h"
 
+// Paramètres
+#define LCD_PERIOD		100	// Période de rafraîchissement de l'écran (ms)
+
 class INTERFACE {
 private:
   pcd8544 *Lcd;
@@ -25,7 +28,6 @@ private:
   void actuLcd();
   void actuLcdParam();
   void actuLcdCalib();
-  uint32 lastLcd;
   boolean lastLcdCalib;
   
   uint16 state;
@@ -8,14 +8,24 @@
 // I N I T I A L I S A T I O N
 //  * * * * * * * * * * * * *
 
-KALMAN::KALMAN(SENSORS *newSensors) {
+KALMAN::KALMAN(SENSORS *newSensors, FLASH *newFlash) {
   Sensors = newSensors;
+  Flash = newFlash;
+  mode = FILTER_KALMAN;
+  fixedDt = false;
+  seq = 0;
+  adaptive = true;
+  fidelity = FIDELITY_FULL;
+  gyroOnly = false;
+  nOver = 0;
+  nUnder = 0;
+  FillA(levelCost, FIDELITY_MAX+1, 0);
+  nSlowP = 0;
 }
 
 void KALMAN::setup() {
-  // Au début on accepte un écart-type 1000x fois supérieur au paramètres,
-  // puis le faisons décroitre selon une exponentielle décroissante, ce pour
-  // que le vecteur d'état s'initialise sans utiliser de procédure spécifique
+  // Si l'initialisation par TRIAD échoue, on accepte au début un écart-type 1000x fois
+  // supérieur au paramètres, puis le faisons décroitre selon une exponentielle décroissante
   ETfact = 1000;
 
   FillA(P, 11*11, 0);
@@ -24,6 +34,121 @@ void KALMAN::setup() {
   
   Q = { VQ, VQ, VQ, VQ, VQ, VQ, VQ, VQ, VB, VB, VB };
   R = { Va, Va, Va, Vg, Vg, Vg, Vm, Vm, Vm };  
+
+  nInit = 0;
+  initWait = 0;
+  FillA(initADXL345, 3, 0);
+  FillA(initMAG3110, 3, 0);
+}
+
+// Orientation initiale en forme close (méthode TRIAD) à partir de la somme des premières mesures
+// On construit deux trièdres orthonormés, l'un à partir des mesures (repère de la centrale),
+// l'autre à partir de la gravité et du nord magnétique (repère terrestre), stockés en lignes ;
+// la matrice de rotation centrale->terre est M = Mt^t.Mc
+boolean KALMAN::initTriad() {
+  float Mc[9], Mt[9], M[9];
+  float uZ[3] = { 0, 0, 1 };
+  float mN[3] = { -20.74, 0, 43.23 };
+
+  // 1er vecteur : la gravité, mesurée avec le moins de bruit
+  // 2e vecteur : perpendiculaire à la gravité et au champ magnétique
+  CopyA(Mc, initADXL345, 3);
+  PrdVV(Mc+3, initADXL345, initMAG3110);
+  CopyA(Mt, uZ, 3);
+  PrdVV(Mt+3, uZ, mN);
+  if ((NormV(Mc) == 0) || (NormV(Mc+3) == 0)) return false; // Mesures dégénérées
+
+  for (uint8 i=0 ; i<2 ; i++) {
+    AddA(Mc+3*i, 1/NormV(Mc+3*i), Mc, 0, 3);
+    AddA(Mt+3*i, 1/NormV(Mt+3*i), Mt, 0, 3);
+  }
+  PrdVV(Mc+6, Mc, Mc+3);
+  PrdVV(Mt+6, Mt, Mt+3);
+
+  PrdM(M, Mt, true, Mc, false, 3, 3, 3); // M=Mt^t.Mc (les trièdres sont stockés en lignes)
+  QuatFromM(X, M);
+  FillA(X+4, 7, 0);
+
+  // Covariance cohérente avec cette initialisation : on peut se passer de la décroissance de ETfact
+  FillA(P, 11*11, 0);
+  for (uint8 i=0 ; i<4 ; i++) P[12*i] = VQ_INIT;
+  for (uint8 i=4 ; i<8 ; i++) P[12*i] = VQ;
+  for (uint8 i=8 ; i<11 ; i++) P[12*i] = VB;
+  ETfact = 1;
+  return true;
+}
+
+// Restauration du biais et de la covariance sauvegardés, si la température n'a pas trop changé
+// Le quaternion sauvegardé n'est utilisé que si la TRIAD a échoué : la centrale a pu être déplacée
+// Aucune horloge ne survit à la coupure d'alimentation : on compense la durée d'arrêt inconnue
+// en gonflant la variance du biais de VB_WARM
+boolean KALMAN::restore() {
+  if ((*Flash).data[FLASH_KALMAN_VALID] != FLASH_KALMAN_MAGIC) return false;
+
+  float temp;
+  (*Flash).readTf(&temp, FLASH_KALMAN_TEMP, 1, 100);
+  if (abs(temp - (*Sensors).temperature) > WARM_TEMP) return false;
+
+  float ET[11];
+  (*Flash).readTf(ET, FLASH_KALMAN_ET, 11, WARM_RANGE_ET);
+  (*Flash).readTf(X+8, FLASH_KALMAN_BIAS, 3, WARM_RANGE_BIAS);
+  CopyA(savedBias, X+8, 3);
+  for (uint8 i=8 ; i<11 ; i++) P[12*i] = sq(ET[i]) + VB_WARM;
+
+  if (ETfact > 1) { // La TRIAD a échoué
+    (*Flash).readTf(X, FLASH_KALMAN_QUAT, 4, 1);
+    NormQ(X);
+    for (uint8 i=0 ; i<8 ; i++) P[12*i] = sq(ET[i]);
+    ETfact = 1;
+  }
+  return true;
+}
+
+boolean KALMAN::biasChanged() {
+  for (uint8 i=0 ; i<3 ; i++)
+    if (abs(X[8+i] - savedBias[i]) > WARM_SAVE_BIAS) return true;
+  return false;
+}
+
+// Chaque sauvegarde efface la page (~10 000 cycles garantis) et bloque le coeur pendant
+// l'effacement : on ne sauvegarde que si le biais a réellement évolué
+boolean KALMAN::save(boolean force) {
+  if ((nInit < INIT_SAMPLES) || ((*Sensors).temperature == TEMPERATURE_UNKNOWN)) return false;
+  if (!force && !biasChanged()) return false;
+  CopyA(savedBias, X+8, 3);
+  float ET[11];
+  for (uint8 i=0 ; i<11 ; i++) ET[i] = fastSqrt(P[12*i]);
+  lastSave = millis();
+
+  (*Flash).writeTf(&(*Sensors).temperature, FLASH_KALMAN_TEMP, 1, 100, false);
+  (*Flash).writeTf(X, FLASH_KALMAN_QUAT, 4, 1, false);
+  (*Flash).writeTf(X+8, FLASH_KALMAN_BIAS, 3, WARM_RANGE_BIAS, false);
+  (*Flash).writeTf(ET, FLASH_KALMAN_ET, 11, WARM_RANGE_ET, false);
+  return (*Flash).write(FLASH_KALMAN_VALID, FLASH_KALMAN_MAGIC); // Une seule écriture de la page
+}
+
+// Avec un pas de temps constant, les facteurs d'échelle de genA() et la décroissance
+// de ETfact ne dépendent plus de l'itération : on les calcule une fois pour toutes, pour un
+// pas d'une période (genA() revient au calcul complet si des tops ont été manqués)
+void KALMAN::setFixedDt(boolean enable) {
+  fixedDt = enable && (*Sensors).fixedDt;
+  if (!fixedDt) return;
+  dtHalf = (*Sensors).dt / 2;
+  dtInv = 1 / (*Sensors).dt;
+  ETdecay = constrain( (*Sensors).dt/2, 0, 1 ); // Cf. lowPassTmp( &ETfact, 1, 2, dt )
+}
+
+// Changement d'estimateur à chaud : on conserve le quaternion et le biais
+void KALMAN::setMode(uint8 newMode) {
+  if (newMode == mode) return;
+  if (newMode == FILTER_KALMAN) {
+    // Le filtre complémentaire ne tient pas à jour P : on repart d'une covariance
+    // nulle et on laisse Q (légèrement gonflé) la faire remonter
+    FillA(P, 11*11, 0);
+    ETfact = max(ETfact, 10);
+  }
+  FillA(levelCost, FIDELITY_MAX+1, 0); // Les coûts mesurés ne valent que pour un estimateur
+  mode = newMode;
 }
 
 
@@ -39,9 +164,12 @@ void KALMAN::genA() {
   FillA(AH, 11*11, 0);
 
   float f, g;
+  boolean oneTick = fixedDt && ((*Sensors).ticks == 1); // Sinon, des tops ont été manqués
+  float h   = oneTick ? dtHalf : (*Sensors).dt/2;
+  float inv = oneTick ? dtInv  : 1/(*Sensors).dt;
   // Il faut que le quaternion reste normé ; on divise donc par la norme du quaternion et par la norme du quaternion (1+dt*Omega/2)
-  g = 1 / sqrt( ( sq(X[0])+sq(X[1])+sq(X[2])+sq(X[3]) )*( 1+sq((*Sensors).dt/2*Y[3])+sq((*Sensors).dt/2*Y[4])+sq((*Sensors).dt/2*Y[5]) ) );
-  f = g * (*Sensors).dt/2;
+  g = fastInvSqrt( ( sq(X[0])+sq(X[1])+sq(X[2])+sq(X[3]) )*( 1+sq(h*Y[3])+sq(h*Y[4])+sq(h*Y[5]) ) );
+  f = g * h;
 
   // Identité partielle
   // On s'arrange pour conserver la norme unitaire de Q=X[0..3]
@@ -63,7 +191,7 @@ void KALMAN::genA() {
   // On complète par antisymétrie et on remplit au passage le 2e carré
   for (uint8 i=0 ; i<4 ; i++) { // ligne
     for (uint8 j=i+1 ; j<4 ; j++) { // colonne
-      AH[11*(i+4)+j] =   AH[11*i+j] / (*Sensors).dt;
+      AH[11*(i+4)+j] =   AH[11*i+j] * inv;
       AH[11*j+i]     = - AH[11*i+j];
       AH[11*(j+4)+i] = - AH[11*(i+4)+j];
     }
@@ -76,8 +204,6 @@ void KALMAN::genA() {
 // Y(t) = H(X).X(t)
 void KALMAN::genH() {
   FillA(AH, 11*11, 0);
-  FillA(measureADXL345_0, 3, 0);
-  FillA(measureMAG3110_0, 3, 0);
 
   // Matrice T tq uZ(centrale/0) = TQ
   T = { 
@@ -86,11 +212,6 @@ void KALMAN::genH() {
      X[0], -X[1], -X[2],  X[3] };
   AddMLoc(AH, 9, 11, 1, T, 3, 4, 9.81, 0, 0); // g
   AddMLoc(AH, 9, 11, 1, T, 3, 4, 43.23, 6, 0); // mN
-  
-  // On calcule la projection des mesures
-  PrdM(T2, T, false, X, false, 4, 3, 1); // T2=uZ(centrale/0)
-  AddM(measureADXL345_0, 1, T2, 9.81, 3, 1);
-  AddM(measureMAG3110_0, 1, T2, 43.23, 3, 1);
 
   // Matrice T tq uX(centrale/0) = TQ
   T = {  
@@ -99,9 +220,6 @@ void KALMAN::genH() {
      X[2],  X[3],  X[0],  X[1] };
   AddMLoc(AH, 9, 11, 1, T, 3, 4, -20.74, 6, 0); // mT
 
-  PrdM(T2, T, false, X, false, 4, 3, 1); // T2=uX(centrale/terre)
-  AddM(measureMAG3110_0, 1, T2, -20.74, 3, 1);
-
   // Matrice tq Omega(centrale) = 2TdQ
   // Le produit Q_dQ est quaternion pur
   T = { 
@@ -116,57 +234,193 @@ void KALMAN::genH() {
 }
 
 
+//  * * * * * * * * * * * * * * * * *
+// B U D G E T   D E   C A L C U L
+//  * * * * * * * * * * * * * * * * *
+
+// La charge se lit au retard de la tâche IMU sur le top d'échantillonnage (Sensors.latency) :
+// carte SD, écran, calibration... la retardent autant que le filtre lui-même. On y ajoute la
+// durée de calcul du niveau courant pour savoir quand le filtre finira ; un top manqué est
+// hors budget d'office. Le budget suit la période, qui s'allonge en basse consommation.
+// On se dégrade d'un niveau après FIDELITY_DOWN itérations hors budget. On ne remonte qu'après
+// FIDELITY_UP itérations où le niveau supérieur, au coût déjà mesuré, tiendrait sous
+// LOOP_MARGIN*LOOP_BUDGET : sans quoi on oscillerait entre deux niveaux.
+void KALMAN::adaptFidelity() {
+  float period = (*Sensors).fixedDt ? (*Sensors).samplePeriod / 1000000. : (*Sensors).dt;
+  float late = (*Sensors).fixedDt ? (*Sensors).latency / 1000000. : 0;
+  boolean over = ((*Sensors).ticks > 1) || (late + levelCost[fidelity] > LOOP_BUDGET*period);
+  boolean room = (fidelity > FIDELITY_FULL) && (late + levelCost[fidelity-1] < LOOP_MARGIN*LOOP_BUDGET*period);
+  if (!adaptive) {
+    fidelity = FIDELITY_FULL;
+  }
+  else if (over) {
+    nUnder = 0;
+    if (++nOver >= FIDELITY_DOWN) {
+      nOver = 0;
+      if (fidelity < FIDELITY_MAX) fidelity++;
+    }
+  }
+  else if (room) {
+    nOver = 0;
+    if (++nUnder >= FIDELITY_UP) {
+      nUnder = 0;
+      fidelity--;
+    }
+  }
+  else {
+    nOver = 0;
+    nUnder = 0;
+  }
+  gyroOnly = (fidelity >= FIDELITY_GYRO);
+}
+
+
 //  * * * * * * * * * * * * * * * * * *
 // E X E C U T I O N   D U   F I L T R E
 //  * * * * * * * * * * * * * * * * * *
 
 void KALMAN::loop() {
   
-  lowPassTmp( &ETfact, 1, 2, (*Sensors).dt );
-  
   for (uint8 i=0 ; i<3 ; i++) {
     Y[i]   = (*Sensors).measureADXL345[i];
     Y[i+3] = (*Sensors).measureITG3200[i];
     Y[i+6] = (*Sensors).measureMAG3110[i];
   }
 
+  // On accumule les premières mesures puis on initialise l'orientation d'un coup
+  // On attend aussi la première mesure de température pour valider la sauvegarde ; si le
+  // BMP085 ne répond pas, on démarre à froid au bout de INIT_TEMP_WAIT
+  if (nInit < INIT_SAMPLES) {
+    AddA(initADXL345, 1, Y,   1, 3);
+    AddA(initMAG3110, 1, Y+6, 1, 3);
+    boolean tempKnown = ((*Sensors).temperature != TEMPERATURE_UNKNOWN);
+    if (nInit < INIT_SAMPLES-1) {
+      if (++nInit == INIT_SAMPLES-1) initWait = millis();
+    }
+    else if (tempKnown || (millis()-initWait > INIT_TEMP_WAIT)) nInit++;
+    if (nInit == INIT_SAMPLES) {
+      initTriad();
+      CopyA(savedBias, X+8, 3);
+      if (tempKnown) restore();
+      lastSave = millis();
+    }
+    timeX = (*Sensors).timeMeasure;
+    publish();
+    return;
+  }
+
+  if (!fixedDt) lowPassTmp( &ETfact, 1, 2, (*Sensors).dt );
+  else if (ETfact != 1) ETfact += (1-ETfact) * ETdecay;
+  adaptFidelity();
+
+  if ((millis()-lastSave > WARM_SAVE_INTERVAL) && biasChanged()) save();
+
+  uint32 start = profileCycles();
+  if (mode == FILTER_MAHONY) loopMahony();
+  else loopKalman();
+  float loopTime = (float)(profileCycles() - start) / (PROFILE_CYCLES_PER_US*1000000.);
+  if (levelCost[fidelity] == 0) levelCost[fidelity] = loopTime;
+  else levelCost[fidelity] += (loopTime - levelCost[fidelity]) * COST_SMOOTH;
+
+  timeX = (*Sensors).timeMeasure;
+  publish();
+}
+
+
+//  * * * * * * * * * * * * *
+// P U B L I C A T I O N
+//  * * * * * * * * * * * * *
+
+// Verrou séquentiel sur double tampon : l'écrivain remplit le tampon que les lecteurs n'utilisent
+// pas, puis incrémente seq. Le lecteur copie le tampon courant et recommence si seq a changé
+// entre-temps, ce qui n'arrive que si une publication complète a eu lieu pendant la copie.
+// Le filtre peut ainsi tourner sous interruption sans jamais attendre ses lecteurs.
+void KALMAN::publish() {
+  SNAPSHOT *s = &snap[(seq+1) & 1];
+
+  s->invalidate();
+  s->time = timeX;
+  CopyA(s->Q, X, 4);
+  for (uint8 i=0 ; i<3 ; i++) s->W[i] = Y[i+3] - X[i+8];
+  s->fidelity = fidelity;
+  s->latencyMax = (*Sensors).latencyMax;
+
+  CopyA(s->measureADXL345, (*Sensors).measureADXL345, 3);
+  CopyA(s->measureITG3200, (*Sensors).measureITG3200, 3);
+  CopyA(s->measureMAG3110, (*Sensors).measureMAG3110, 3);
+  s->temperature = (*Sensors).temperature;
+  s->pressure = (*Sensors).pressure;
+  s->refAlt = (*Sensors).refAlt;
+  s->refPress = (*Sensors).refPress;
+
+  COMPILER_BARRIER();
+  seq++;
+}
+
+void KALMAN::read(SNAPSHOT *dst) {
+  uint32 s;
+  do {
+    s = seq;
+    COMPILER_BARRIER();
+    *dst = snap[s & 1];
+    COMPILER_BARRIER();
+  } while (s != seq);
+}
+
+void KALMAN::loopKalman() {
+
   // *****************************
   // Phase de prédiction, ici AH=A
 
+  PROFILE_BEGIN(PROFILE_GENA);
   this->genA();
+  PROFILE_END(PROFILE_GENA);
 
+  PROFILE_BEGIN(PROFILE_PREDICT);
   PrdM(T, AH, false, X, false, 11, 11, 1); // T=AX
   CopyA(X, T, 11); // X=AX
   
-  PrdM(T, AH, false, P, false, 11, 11, 11); // T=AP
-  PrdM(P, T, false, AH, true, 11, 11, 11); // P=TAt=APAt
+  // En surcharge, la propagation de P (le calcul le plus coûteux) n'est faite qu'une fois sur SLOW_P_DECIM
+  if ((fidelity < FIDELITY_SLOW_P) || (nSlowP == 0)) {
+    PrdM(T, AH, false, P, false, 11, 11, 11); // T=AP
+    PrdM(P, T, false, AH, true, 11, 11, 11); // P=TAt=APAt
+  }
+  nSlowP = (nSlowP+1) % SLOW_P_DECIM;
   AddMDiagLoc(P, 11, 11, Q, ETfact, 11, 0, 0); // P=APAt+Q' avec Q'=Q*ETfact
+  PROFILE_END(PROFILE_PREDICT);
 
   // *****************************
 
   // Ici, Q est parfaitement normé
-  
-  CalcCardan(Cardan, X); // On calcule les angles de Cardan
+
+  if (gyroOnly) return;
 
   // ******************************
   // Phase de mise à jour, ici AH=H
 
+  PROFILE_BEGIN(PROFILE_GENH);
   this->genH();
+  PROFILE_END(PROFILE_GENH);
+
+  PROFILE_BEGIN(PROFILE_UPDATE);
+
+  // Les magnétomètres sont les 3 dernières lignes de Y et H : il suffit de les ignorer
+  uint8 n = (fidelity >= FIDELITY_NO_MAG) ? 6 : 9;
 
-  PrdM(K, AH, false, P, false, 9, 11, 11); // K=HP
-  PrdM(T, K, false, AH, true, 9, 11, 9);  // T=KHt=HPHt
-  AddMDiagLoc(T, 9, 9, R, 1, 9, 0, 0); // T=HPHt+R
-  InvM(T, 9); // T=(HPHt+R)^(-1)
-  PrdM(K, AH, true, T, false, 11, 9, 9); // K=HtT=Ht(HPHt+R)^(-1)
-  PrdM(T, P, false, K, false, 11, 11, 9); // K=PHt(R'+HPHt)^(-1)
-  CopyA(K, T, 11*9);
-
-  PrdM(T2, AH, false, X, false, 9, 11, 1); // T=HX
-  AddM(T2, -1, Y, 1, 9, 1); // T=Y-HX
-  PrdM(T, K, false, T2, false, 11, 9, 1); // T=K(Y-HX)
+  PrdM(K, AH, false, P, false, n, 11, 11); // K=HP
+  PrdM(T, K, false, AH, true, n, 11, n);  // T=KHt=HPHt
+  AddMDiagLoc(T, n, n, R, 1, n, 0, 0); // T=HPHt+R
+  InvM(T, n); // T=(HPHt+R)^(-1)
+  PrdM(K, AH, true, T, false, 11, n, n); // K=HtT=Ht(HPHt+R)^(-1)
+  PrdM(T, P, false, K, false, 11, 11, n); // K=PHt(R'+HPHt)^(-1)
+  CopyA(K, T, 11*n);
+
+  PrdM(T2, AH, false, X, false, n, 11, 1); // T=HX
+  AddM(T2, -1, Y, 1, n, 1); // T=Y-HX
+  PrdM(T, K, false, T2, false, 11, n, 1); // T=K(Y-HX)
   AddM(X, T, 11, 1); // X=X+K(Y-HX)
 
-  PrdM(T, K, false, AH, false, 11, 9, 11); // T=KH
+  PrdM(T, K, false, AH, false, 11, n, 11); // T=KH
   for (uint8 i=0 ; i<11 ; i++) { // T=I-KH
     for (uint8 j=0 ; j<11 ; j++) T[11*i+j] = 1*(i==j) - T[11*i+j];
   }
@@ -174,8 +428,45 @@ void KALMAN::loop() {
   CopyA(P, K, 11*11); // P=K=(I-KH)P
   // K ne servira plus à rien, on l'utilise ici comme intermédiaire de calcul
   // Ca évite d'avoir à déclarer une 2e matrice temporaire de dimension 11x11 ...
+  PROFILE_END(PROFILE_UPDATE);
 
   // ******************************
   
 }
 
+// Filtre complémentaire non-linéaire de Mahony
+// Les directions mesurées de la gravité et du champ magnétique sont comparées à celles prédites
+// par le quaternion ; le produit vectoriel donne une vitesse de rotation de recalage, dont
+// l'intégrale donne le biais gyroscopique (rangé comme pour le filtre de Kalman dans X[8..10])
+void KALMAN::loopMahony() {
+  float dt = (*Sensors).dt;
+  float E[3], W[3];
+  float A0[3], M0[3];
+  float n;
+
+  CalcProj(A0, M0, X);
+  FillA(E, 3, 0);
+
+  // Recalage par les accéléromètres
+  n = NormV(Y) * NormV(A0);
+  if ((n > 0) && !gyroOnly) {
+    PrdVV(W, Y, A0);
+    AddA(E, 1, W, 1/n, 3);
+  }
+
+  // Recalage par les magnétomètres
+  n = NormV(Y+6) * NormV(M0);
+  if ((n > 0) && (fidelity < FIDELITY_NO_MAG)) {
+    PrdVV(W, Y+6, M0);
+    AddA(E, 1, W, 1/n, 3);
+  }
+
+  // Biais et vitesse de rotation corrigée
+  AddA(X+8, 1, E, -KI_MAHONY*dt, 3);
+  for (uint8 i=0 ; i<3 ; i++) W[i] = Y[i+3] - X[i+8] + KP_MAHONY*E[i];
+
+  // Intégration du quaternion ; X[4..7] contient sa dérivée comme pour le filtre de Kalman
+  DerQ(X+4, X, W);
+  AddA(X, 1, X+4, dt, 4);
+  NormQ(X);
+}
@@ -6,7 +6,10 @@
 
 #include "wirish.h"
 #include "sensors.h"
+#include "store.h"
 #include "maths.h"
+#include "snapshot.h"
+#include "profile.h"
 
 //#include "pcd8544.h"
 
@@ -18,20 +21,85 @@ const float Va = 3;		// Accéléromètres (reglé empiriquement)
 const float Vg = 0.004;		// Gyromètres : bruit de 0.38 °/s rms
 const float Vm = 7;		// Magnétomètres : bruit de 4 uT rms
 
+// Initialisation (TRIAD)
+#define INIT_SAMPLES		8	// Nombre de mesures moyennées avant de résoudre l'orientation initiale
+#define INIT_TEMP_WAIT		2000	// Attente maxi de la première température (ms), puis démarrage à froid
+const float VQ_INIT = 0.0004;	// Variance initiale sur le quaternion (environ 1° d'erreur)
+
+// Démarrage à chaud : sauvegarde de l'état en Flash
+#define WARM_SAVE_BIAS		0.002	// Ecart de biais (rad/s) justifiant une nouvelle sauvegarde
+#define WARM_SAVE_INTERVAL	600000	// Délai mini entre deux sauvegardes (ms) ; limite l'usure de la Flash
+#define WARM_TEMP		3	// Ecart de température maxi pour réutiliser la sauvegarde (°C)
+#define WARM_RANGE_BIAS		0.5	// Amplitude du biais stocké (rad/s)
+#define WARM_RANGE_ET		1	// Amplitude des écarts-types stockés
+const float VB_WARM = 0.0001;	// Variance ajoutée au biais restauré (durée d'arrêt inconnue)
+
+// Gains du filtre complémentaire (Mahony)
+const float KP_MAHONY = 1;	// Gain proportionnel de recalage (rad/s)
+const float KI_MAHONY = 0.02;	// Gain intégral : estimation du biais gyroscopique (rad/s²)
+
+// Budget de calcul : au-delà, le filtre se dégrade progressivement
+#define LOOP_BUDGET		0.8	// Fraction de la période d'échantillonnage, comptée depuis le top, où le filtre doit avoir fini
+#define LOOP_MARGIN		0.6	// Fraction du budget en dessous de laquelle on considère avoir de la marge
+#define COST_SMOOTH		0.1	// Lissage de la durée de calcul mesurée pour chaque niveau
+#define FIDELITY_DOWN		5	// Nombre d'itérations consécutives hors budget avant dégradation
+#define FIDELITY_UP		50	// Nombre d'itérations consécutives avec marge avant rétablissement
+#define SLOW_P_DECIM		4	// En FIDELITY_SLOW_P, P n'est propagée qu'une itération sur SLOW_P_DECIM
+
+// Constantes
+// Niveaux de fidélité du filtre (du plus complet au plus dégradé)
+#define FIDELITY_FULL		0	// Toutes les mesures sont utilisées
+#define FIDELITY_NO_MAG		1	// Pas de mise à jour par les magnétomètres
+#define FIDELITY_GYRO		2	// Propagation gyroscopique seule (gyroOnly)
+#define FIDELITY_SLOW_P		3	// Idem, et propagation de la covariance ralentie
+#define FIDELITY_MAX		FIDELITY_SLOW_P
+
+// Modes d'estimation (les sorties sont identiques dans les deux cas)
+#define FILTER_KALMAN		0	// Filtre de Kalman complet à 11 états
+#define FILTER_MAHONY		1	// Filtre complémentaire sur le quaternion, environ 100x moins coûteux
+
 class KALMAN {
 private:
   SENSORS *Sensors;
+  FLASH *Flash;
 
   float ETfact;		// Facteur multiplicatif de Q
   float dt;		// Récupéré sur Sensors
+
+  // Facteurs précalculés lorsque dt est constant (échantillonnage sur interruption)
+  boolean fixedDt;
+  float dtHalf, dtInv, ETdecay;
   float T[11*11];	// tmp
   float T2[9];		// tmp
 
   void genA();
   void genH();
+
+  uint8 nInit;		// Nombre de mesures accumulées pour l'initialisation
+  uint32 initWait;	// millis() du début de l'attente de la température
+  float initADXL345[3];
+  float initMAG3110[3];
+  boolean initTriad();
+
+  uint32 lastSave;
+  float savedBias[3];	// Biais de la dernière sauvegarde (ou restauration)
+  boolean biasChanged();
+  boolean restore();
+
+  SNAPSHOT snap[2];	// Double tampon
+  volatile uint32 seq;	// Numéro de publication : snap[seq&1] est le dernier publié
+  void publish();
+
+  uint8 nOver, nUnder;	// Compteurs d'itérations hors budget / avec marge
+  float levelCost[FIDELITY_MAX+1];	// Durée de calcul lissée de chaque niveau (s), 0 tant qu'il n'a pas tourné
+  uint8 nSlowP;
+  void adaptFidelity();
+
+  void loopKalman();
+  void loopMahony();
   
 public:
-  KALMAN(SENSORS *newSensors);
+  KALMAN(SENSORS *newSensors, FLASH *newFlash);
 
   float X[11];		// Vecteur d'état
   float Y[9];		// Vecteur de mesure
@@ -43,15 +111,25 @@ public:
   float Q[11];		// Matrice diag. de covariance maxi sur X (à définir)
   float R[9];		// Matrice diag. de covariance sur Y (à définir)
   
-  float Cardan[3];	// Angles de cardan
-  
-  float measureADXL345_0[3];
-  float measureMAG3110_0[3];
+  uint32 timeX;		// Date (micros) à laquelle X est valable
+
+  // Instantané publié à la fin de chaque itération, lisible sans verrou ; les sorties dérivées
+  // (Cardan, projections) y sont calculées à la demande
+  void read(SNAPSHOT *dst);
 
   void setup();
   void loop();
+  // Sauvegarde de l'état en Flash, si le biais a changé de plus de WARM_SAVE_BIAS depuis la
+  // précédente (ou toujours si force) : à appeler avant un arrêt contrôlé ou une mise en veille
+  boolean save(boolean force = false);
+
+  uint8 mode;
+  void setMode(uint8 newMode);
+  void setFixedDt(boolean enable); // A appeler après chaque changement de Sensors.dt constant
   
-  boolean gyroOnly;
+  boolean adaptive;	// Dégradation automatique selon la charge (retard de la tâche IMU)
+  uint8 fidelity;	// Niveau de fidélité actuel (FIDELITY_...)
+  boolean gyroOnly;	// Vrai si aucune mise à jour n'est effectuée
 };
 
 #endif // _KALMAN_H_
@@ -3,51 +3,147 @@
 
 #include "log.h"
 
+// Fréquence (Hz) et priorité par défaut des champs du paquet auxiliaire, par code
+static const uint8 AUX_RATE[TM_FIELDS] = {
+  0,  0,  24, 24,	// KEY, DT, QUAT_5, QUAT_8
+  1,  4,  4,		// TEMP, PRESS, ALTI
+  10, 10, 10,		// ACC_6, ACC0_3, ACC0_6
+  10, 10, 10,		// MAG_6, MAG0_3, MAG0_6
+  10, 1,  2,		// GYRZ_6, FIDELITY, JITTER
+  24, 24,		// QUAT_4, TIME
+  0,  0,  0,  0,  0 };	// SYNC, ECHO, ACK, PARAM, PERF : hors masque
+static const uint8 AUX_PRIORITY[TM_FIELDS] = {
+  1, 1, 8, 8,
+  1, 2, 2,
+  4, 4, 4,
+  4, 4, 4,
+  4, 1, 1,
+  8, 8,
+  0, 0, 0, 0, 0 };
+
+// Instance servie par l'interruption DMA
+static LOG *txLog = NULL;
+
+static void txDmaIsr() {
+  if (txLog != NULL) txLog->txDone();
+}
+
 
 // * * * * * * * * * * * * * * *
 //  I N I T I A L I S A T I O N
 // * * * * * * * * * * * * * * *
 
-LOG::LOG(SENSORS *newSensors, KALMAN *newKalman, HardwareSPI *newSpi) {
+LOG::LOG(SENSORS *newSensors, KALMAN *newKalman, HardwareSPI *newSpi) : Sd(newSpi) {
   Sensors = newSensors;
   Kalman = newKalman;
-  Spi = newSpi;
   key = 0;
-  nSync = 0;
+  lastDt = 0;
+  for (uint8 i=0 ; i<AUX_MASK_LENGTH ; i++) auxLast[i] = 0;
+  for (uint8 i=0 ; i<MAIN_MASK_LENGTH ; i++) maskMain[i] = maskNext[i] = MASK_END;
+  for (uint8 i=0 ; i<AUX_MASK_LENGTH ; i++) maskAux[i] = MASK_END;
+  for (uint8 i=0 ; i<TM_FIELDS ; i++) {
+    rateAux[i] = AUX_RATE[i];
+    priorityAux[i] = AUX_PRIORITY[i];
+  }
+  nPacket = 0;
+  seq = 0;
+  syncTime = 0;
+  txTime = 0;
+  lastSync = 0;
+  replyHead = 0;
+  replyTail = 0;
+  replyDrops = 0;
+  lastCommand = 0;
+  lenAux = AUX_MAX_LENGTH;
+  sdTelemetry = true;
+  delta = deltaNext = DELTA_ENABLE;
+  nKeyframe = 0;
+  mainPending = false;
+  announceLeft = 0;
+  lastAnnounce = 0;
+  maskGen = genNext = 0;
+  txHead = 0;
+  txTail = 0;
+  txDmaLen = 0;
+  txDrops = 0;
 }
 
 void LOG::setup() {
   Serial.begin(BAUD_RATE);
-  Serial.println("truc");
-  return;
-  
-  if (!setupSD()) return;
-  newFile();
+
+  // L'USART demande un octet au DMA dès que son registre d'émission est vide
+  txLog = this;
+  dma_init(DMA1);
+  dma_attach_interrupt(DMA1, SERIAL_DMA_CH, txDmaIsr);
+  SERIAL_USART->CR3 |= USART_CR3_DMAT;
+
+  if (Sd.setup()) Sd.open();
+}
+
+
+//  * * * * * * * * * * * * * *
+// E M I S S I O N   P A R   D M A
+//  * * * * * * * * * * * * * *
+
+uint16 LOG::txFree() {
+  return (txTail + TX_RING_LENGTH - txHead - 1) % TX_RING_LENGTH;
 }
 
-boolean LOG::setupSD() {
-  if (!Root.isOpen()) {
-    if (!Card.init(Spi)) return false;
-    delay(100);
-    if (!Volume.init(&Card)) return false;
-    if (!Root.openRoot(&Volume)) return false;
+// Lance un transfert DMA sur la plus longue plage contiguë en attente, si le DMA est libre.
+// Appelée aussi sous interruption (txDone) : l'état des interruptions (PRIMASK) est restauré
+// tel qu'il était, sans les réactiver au milieu de l'ISR
+void LOG::txKick() {
+  uint32 primask;
+  asm volatile("mrs %0, primask" : "=r" (primask));
+  asm volatile("cpsid i" ::: "memory");
+  if ((txDmaLen == 0) && (txHead != txTail)) {
+    txDmaLen = (txHead > txTail) ? txHead - txTail : TX_RING_LENGTH - txTail;
+    dma_setup_transfer(DMA1, SERIAL_DMA_CH, &SERIAL_USART->DR, DMA_SIZE_8BITS,
+                       txRing + txTail, DMA_SIZE_8BITS, DMA_MINC_MODE | DMA_FROM_MEM | DMA_TRNS_CMPLT);
+    dma_set_num_transfers(DMA1, SERIAL_DMA_CH, txDmaLen);
+    dma_enable(DMA1, SERIAL_DMA_CH);
   }
-  return true;
+  asm volatile("msr primask, %0" :: "r" (primask) : "memory");
 }
 
-boolean LOG::newFile() {
-  if (File.isOpen()) {
-    if (!File.close()) return false;
+void LOG::txDone() {
+  dma_disable(DMA1, SERIAL_DMA_CH);
+  txTail = (txTail + txDmaLen) % TX_RING_LENGTH;
+  txDmaLen = 0;
+  txKick(); // La suite éventuelle (après retour au début du tampon)
+}
+
+
+//  * * * * * * * * * * * * * *
+// M I S E   E N   T R A M E
+//  * * * * * * * * * * * * * *
+
+// La trame complète va sur la carte SD (hors capture brute) ; sur la liaison série, elle est abandonnée
+// entière si le tampon d'émission n'a pas la place (le client le voit au numéro de séquence)
+void LOG::sendFrame() {
+  uint16 crc = crc16(packet, nPacket);
+  packet[nPacket++] = crc >> 8;
+  packet[nPacket++] = crc & 0xFF;
+  uint8 frame[FRAME_MAX_LENGTH];
+  uint16 len = cobsEncode(packet, nPacket, frame);
+  frame[len++] = FRAME_DELIMITER;
+  nPacket = 0;
+  seq++;
+
+  if (sdTelemetry) for (uint16 i=0 ; i<len ; i++) Sd.write(frame[i]); // Simple copie en RAM : les secteurs sont écrits par Sd.loop()
+
+  if (txFree() < len) {
+    txDrops++;
+    return;
   }
-  char Buffer[12] = "LOG_000.BIN";
-  for (uint8 i=0 ; i<100 ; i++) {
-    Buffer[5] = '0' + i/100;
-    Buffer[6] = '0' + (i/10)%10;
-    Buffer[7] = '0' + i%100;
-    if (File.open(&Root,Buffer,O_CREAT|O_EXCL|O_WRITE)) break;
-    if (i == 999) return false;
+  // txHead n'est publié qu'à la fin : l'interruption DMA ne voit jamais de trame incomplète
+  uint16 head = txHead;
+  for (uint16 i=0 ; i<len ; i++) {
+    txRing[head] = frame[i];
+    head = (head + 1) % TX_RING_LENGTH;
   }
-  return true;
+  txHead = head;
+  txKick();
 }
 
 
@@ -55,128 +151,244 @@ boolean LOG::newFile() {
 // E C R I T U R E   S I M P L E
 //  * * * * * * * * * * * * * *
 
+// La taille du paquet est bornée par PACKET_MAX_LENGTH : ici le tampon ne peut pas déborder
 uint8 LOG::write(const uint8 data) {
   key = key*13 + data;
-  Serial.write( data );
-  if (File.isOpen()) {
-    if (nSync ++ >= 512) {
-      File.sync();
-      nSync = 0;
-    }
-    File.write(data);
-  }
+  packet[nPacket++] = data;
   return 1;
 }
 
-uint8 LOG::write(const uint64 data, boolean useBuffer, uint8 n) {
-  if (useBuffer) {
-    // On insère data en haut du buffer
-    Buffer |= data << nBuffer;
-    nBuffer += n;
+// * * * * * * * * * * * * * *
+//  E N V O I   D O N N E E S
+// * * * * * * * * * * * * * *
+
+float LOG::dtPacket() {
+  float dt = millis()-lastDt;
+  lastDt = millis();
+  return dt;
+}
+
+uint32 LOG::syncPacket() {
+  syncTime = txTime;
+  lastSync = millis();
+  return syncTime;
+}
+
+uint8 LOG::replyUsed() {
+  return (replyHead + REPLY_QUEUE - replyTail) % REPLY_QUEUE;
+}
+
+boolean LOG::reply(uint8 code, uint32 a, uint32 b, uint32 c, uint32 d) {
+  uint8 next = (replyHead + 1) % REPLY_QUEUE;
+  if (next == replyTail) {
+    replyDrops++;
+    return false;
   }
-  else {
-    // On écrit chaque octet en partant du haut de data, et on calcule la clé
-    for (uint8 i=n-1 ; i>=0 ; i--)
-      write( (data>>(8*i)) % 256 );
+  replyCode[replyHead] = code;
+  replyValue[replyHead][0] = a;
+  replyValue[replyHead][1] = b;
+  replyValue[replyHead][2] = c;
+  replyValue[replyHead][3] = d;
+  replyHead = next;
+  return true;
+}
+
+void LOG::replyPacket(uint32 *u) {
+  for (uint8 i=0 ; i<TM_MAX_COUNT ; i++) u[i] = replyValue[replyTail][i];
+  replyTail = (replyTail + 1) % REPLY_QUEUE;
+}
+
+// Octets occupés sur la liaison par une trame dont le paquet principal suit mask, dans le
+// pire cas hors paquet auxiliaire : image clé, SYNC, octet de code COBS et délimiteur
+uint16 LOG::mainLength(const uint8 *mask) {
+  uint16 len = FRAME_HEADER + 1 + (1+4) + FRAME_CRC + 2;
+  for (uint8 i=0 ; (i<MAIN_MASK_LENGTH) && (tmLength(mask[i]) > 0) ; i++) len += tmLength(mask[i]);
+  return len;
+}
+
+void LOG::keyframe() {
+  nKeyframe = 0;
+}
+
+// auxLast est indexé par position dans le masque : il ne vaut plus rien pour le nouveau
+void LOG::setAux(const uint8 *codes) {
+  for (uint8 i=0 ; i<AUX_MASK_LENGTH ; i++) {
+    maskAux[i] = codes[i];
+    auxLast[i] = 0;
   }
-  return n; // Renvoit le nombre d'octets écrits
 }
 
-uint8 LOG::writeBuffer(uint8 n) {
-  for (uint8 i=n-1 ; i>=0 ; i--)
-    write( (Buffer>>(8*i)) % 256 );
-  nBuffer -= n;
-  return n; // Renvoit le nombre d'octets écrits
+// Les paquets déjà construits suivent l'ancien masque : le nouveau n'est appliqué qu'une fois
+// l'annonce partie, les réponses en attente la précédant (une place reste pour l'ACK)
+boolean LOG::setMain(const uint8 *codes, boolean newDelta) {
+  if (mainPending || (replyUsed() + ANNOUNCE_LENGTH + 1 > REPLY_QUEUE-1)) return false;
+  for (uint8 i=0 ; i<MAIN_MASK_LENGTH ; i++) maskNext[i] = codes[i];
+  deltaNext = newDelta;
+  genNext = (maskGen + 1) & TM_GEN_MASK;
+  announce();
+  mainPending = true;
+  return true;
 }
 
-uint8 LOG::writeTab(const float* data, uint8 len, float min, float max, boolean useBuffer, uint8 n) {
-  for (uint8 i=0 ; i<len ; i++)
-    write( ftoi( data[i], min, max, 8*n ), useBuffer, n );
-  return len*n;
+// Hors changement, maskNext est le masque en vigueur : l'annonce est alors une simple répétition
+void LOG::announce() {
+  uint8 used = replyUsed();
+  for (uint8 i=0 ; i<TM_MASK_WORDS(MAIN_MASK_LENGTH) ; i++)
+    reply(MASK_PARAM, PARAM_MASK_MAIN+i, tmMaskWord(maskNext, MAIN_MASK_LENGTH, i));
+  reply(MASK_PARAM, PARAM_DELTA, deltaNext);
+  reply(MASK_PARAM, PARAM_MASK_GEN, genNext);
+  announceLeft = used + ANNOUNCE_LENGTH;
+  lastAnnounce = millis();
 }
 
+boolean LOG::isLinked() {
+  return (lastCommand != 0) && (millis()-lastCommand < LINK_TIMEOUT);
+}
 
-// * * * * * * * * * * * * * *
-//  E N V O I   D O N N E E S
-// * * * * * * * * * * * * * *
+float LOG::jitterPacket() {
+  return Snap.latencyMax;
+}
+
+// Seule l'acquisition dépend du champ : le codage est entièrement décrit par TM_SCHEMA. Une
+// fonction par champ est générée depuis telemetry.h, et la table est indexée par le code
+// (u : les champs TM_UINT fournissent directement les entiers)
+#define TM_SOURCE_DEF(name, codec, n, bits, min, max, src) \
+  void LOG::source##name(float *v, uint32 *u) { src; }
+TELEMETRY_FIELDS(TM_SOURCE_DEF)
 
-uint8 LOG::writeData(uint8 b, boolean useBuffer) {
-  uint64 data = 0;
-  // Même si le switch n'est pas pratique, il représente un bon gain de performance par rapport à une énumération de if
-  switch(b) {
-  case MASK_END : return false;
-  case MASK_KEY :
-    // ATTENTION : la clé est mis à jour pendant l'envoi donc ne doit faire que 1 octet
-    write(key, useBuffer);
-    key = 0;
+#define TM_SOURCE_PTR(name, codec, n, bits, min, max, src)	&LOG::source##name,
+const LOG::SOURCE LOG::sources[TM_FIELDS] = { TELEMETRY_FIELDS(TM_SOURCE_PTR) };
+
+// frame : TM_FRAME_ABS (valeurs absolues, sans référence : paquet auxiliaire et réponses),
+// TM_FRAME_KEY (valeurs absolues, qui deviennent la référence) ou TM_FRAME_DELTA (écarts à la référence)
+uint8 LOG::encodeField(uint8 code, uint8 *out, uint8 frame) {
+  if (code >= TM_FIELDS) return 0;
+  // ATTENTION : la clé est mise à jour pendant l'envoi, elle n'a de sens que dans le paquet principal
+  if (code == MASK_KEY) {
+    out[0] = key;
     return 1;
-  case MASK_DT :
-    data = constrain( millis()-lastDt, 0, 255 );
-    lastDt = millis();
-    return write(data, useBuffer);
-  case MASK_QUAT_5 :
-    data = 0;
-    for (uint8 i=0 ; i<3 ; i++) data = (data<<13) | ftoi((*Kalman).X[i], -1, 1, 13);
-    data = (data<<13) | ((*Kalman).X[3] > 0);
-    return write(data, useBuffer, 5);
-  case MASK_TEMP  : return write( ftoi((*Sensors).temperature, -5, 45), useBuffer );
-  case MASK_PRESS : return write( ftoi((*Sensors).pressure, 30000, 1200000, 2*8), useBuffer, 2);
-  case MASK_ALTI  : return write( ftoi((*Sensors).altitude(), -500, 7000, 2*8), useBuffer, 2);
-  case MASK_ACC_6  : return writeTab( (*Sensors).measureADXL345, 3, -(*Sensors).rangeADXL345, (*Sensors).rangeADXL345, useBuffer, 2);
-  case MASK_ACC0_3 : return writeTab( (*Kalman).measureADXL345_0, 3, -(*Sensors).rangeADXL345, (*Sensors).rangeADXL345, useBuffer, 1);
-  case MASK_ACC0_6 : return writeTab( (*Kalman).measureADXL345_0, 3, -(*Sensors).rangeADXL345, (*Sensors).rangeADXL345, useBuffer, 2);
-  case MASK_MAG_6  : return writeTab( (*Sensors).measureMAG3110, 3, -(*Sensors).rangeMAG3110, (*Sensors).rangeMAG3110, useBuffer, 2);
-  case MASK_MAG0_3 : return writeTab( (*Kalman).measureMAG3110_0, 3, -100, 100, useBuffer, 1);
-  case MASK_MAG0_6 : return writeTab( (*Kalman).measureMAG3110_0, 3, -(*Sensors).rangeMAG3110, (*Sensors).rangeMAG3110, useBuffer, 2);
   }
+  float v[TM_MAX_COUNT];
+  uint32 q[TM_MAX_COUNT];
+  (this->*sources[code])(v, q);
+  if (TM_SCHEMA[code].codec != TM_UINT) tmQuantize(code, v, q);
+  uint8 n = (frame == TM_FRAME_DELTA) ? tmPackDelta(code, q, tmLast[code], out) : tmPack(code, q, out);
+  if (frame != TM_FRAME_ABS)
+    for (uint8 i=0 ; i<TM_MAX_COUNT ; i++) tmLast[code][i] = q[i];
+  return n;
 }
 
-void LOG::loop() {
-  
-  // Ecoute de l'ordinateur client
-  if (!isListening && (millis()-lastListen > 2000)) {
-    isListening = true;
-    lastListen = millis();
+uint8 LOG::writeField(uint8 code, uint8 frame) {
+  uint8 data[TM_MAX_DELTA_LENGTH];
+  uint8 n = encodeField(code, data, frame);
+  for (uint8 i=0 ; i<n ; i++) write(data[i]);
+  if (code == MASK_KEY) key = 0;
+  return n;
+}
+
+//  * * * * * * * * * * * * * * * * * *
+// P A Q U E T   A U X I L I A I R E
+//  * * * * * * * * * * * * * * * * * *
+
+// Date absolue et réponses aux commandes : hors budget et hors masque, pour que le client
+// puisse toujours dater les paquets et ne pas attendre ses acquittements. Placées en tête du
+// paquet, elles se lisent sans le masque principal ; renvoit leur nombre (cf. TM_HEADER)
+// (ECHO : la date d'émission est celle de la construction du paquet, pas de sa sortie du DMA)
+uint8 LOG::writeReplies() {
+  uint8 n = 0;
+  if (millis()-lastSync >= SYNC_INTERVAL) {
+    write(MASK_SYNC);
+    writeField(MASK_SYNC);
+    n++;
   }
-  if (isListening && (millis()-lastListen > 100)) {
-    isListening = false;
-    lastListen = millis();
+  for (uint8 i=0 ; (i<REPLY_PER_PACKET) && (replyTail != replyHead) ; i++) {
+    uint8 code = replyCode[replyTail];
+    write(code);
+    writeField(code);
+    n++;
+    if (announceLeft > 0) announceLeft--;
   }
-  if ((isListening) && (enableListen)) return;
-  
-  // Respect du nombre de paquets /sec
-  if (millis()-lastPacket < 1000/24) return;
-  lastPacket = millis();
+  return n;
+}
+
+// Place laissée au paquet auxiliaire par le paquet principal déjà construit, dans le débit de
+// la liaison. Si la liaison a pris du retard (plus d'un paquet en attente), on le rattrape.
+uint8 LOG::auxBudget() {
+  int16 budget = SLOT_LENGTH - (nPacket + FRAME_CRC + 2); // + octets de code COBS et délimiteur
+  int16 backlog = (TX_RING_LENGTH-1 - txFree()) - SLOT_LENGTH;
+  if (backlog > 0) budget -= backlog;
+  budget = constrain(budget, 0, min(lenAux, AUX_MAX_LENGTH));
+  return budget;
+}
+
+// Chaque champ auxiliaire est précédé de son code. Les champs sont choisis par valeur
+// décroissante : priorité x nombre de périodes écoulées depuis le dernier envoi. Les champs
+// en retard passent donc en premier, et la place restante va aux plus anciens.
+void LOG::writeAux(uint8 budget) {
+  uint32 now = millis();
+  float value[AUX_MASK_LENGTH];
+  for (uint8 i=0 ; i<AUX_MASK_LENGTH ; i++) {
+    uint8 code = maskAux[i];
+    value[i] = -1;
+    if ((tmLength(code) == 0) || (code == MASK_KEY) || (code >= TM_FIRST_REPLY)) continue;
+    float age = now - auxLast[i];
+    value[i] = priorityAux[code] * age * ((rateAux[code] > 0) ? rateAux[code] / 1000. : 0.0001);
+  }
+  while (budget > 1) {
+    uint8 best = AUX_MASK_LENGTH;
+    for (uint8 i=0 ; i<AUX_MASK_LENGTH ; i++)
+      if ((value[i] > 0) && (1 + tmLength(maskAux[i]) <= budget) && ((best == AUX_MASK_LENGTH) || (value[i] > value[best])))
+        best = i;
+    if (best == AUX_MASK_LENGTH) break;
+    write(maskAux[best]);
+    budget -= 1 + writeField(maskAux[best]);
+    auxLast[best] = now;
+    value[best] = -1;
+  }
+}
+
+void LOG::loop() {
   
+  // Le nombre de paquets /sec est assuré par l'ordonnanceur (PACKET_RATE)
+  (*Kalman).read(&Snap);
+  txTime = micros();
+  packet[nPacket++] = seq;
+
+  // L'en-tête (génération du masque, nombre de réponses, codage) est complété une fois les
+  // réponses écrites
+  uint16 header = nPacket++;
+  if (!mainPending && (millis()-lastAnnounce >= ANNOUNCE_INTERVAL) && (replyUsed() + ANNOUNCE_LENGTH + 1 <= REPLY_QUEUE-1))
+    announce();
+  uint8 nReply = writeReplies();
+
   // *************************
-  // Envoi du paquet principal
+  // Envoi du paquet principal (vide tant qu'aucun masque n'est défini : la trame ne porte que
+  // SYNC et les réponses). En codage différentiel, l'en-tête indique si le paquet est une
+  // image clé
+  uint8 frame = TM_FRAME_ABS;
+  if (delta) {
+    frame = (nKeyframe == 0) ? TM_FRAME_KEY : TM_FRAME_DELTA;
+    nKeyframe = (nKeyframe + 1) % KEYFRAME_INTERVAL;
+  }
+  packet[header] = TM_HEADER(maskGen, nReply, frame);
   for (uint8 i=0 ; i<MAIN_MASK_LENGTH ; i++)
-    if (!writeData(maskMain[i], false)) break;
+    if (!writeField(maskMain[i], frame)) break;
   
   // **************************
   // Envoi du paquet auxiliaire
-  
-  // On vérifie que le masque est valide
-  if (maskMain[0] == 0) {
-    for (uint8 i=0 ; i<lenAux ; i++) write((uint8)0);
-    return;
-  }
-  
-  uint8 len = 0;
-  len += writeBuffer( min(nBuffer,lenAux) ); // On vide le buffer
-
-  // S'il reste de la place dans le paquet auxiliaire, on remplit le buffer avec l'information suivante
-  while (len < lenAux) {
-    // Si on arrive en bout de masque, on recommence du début
-    if ((writeData(maskMain[posAux], true)==0) || (posAux==AUX_MASK_LENGTH-1)) posAux = 0;
-    else posAux++;
-    // On vide le buffer, dans la limite de longueur du paquet
-    len += writeBuffer( min(nBuffer,lenAux-len) );
-  }
+  writeAux(auxBudget());
 
-  // ***************  
-  // Envoi de la clé
-  writeData(MASK_KEY, false);
+  // Le paquet complet part en arrière-plan
+  sendFrame();
+
+  // L'annonce d'un changement de masque vient de partir : le paquet suivant l'applique
+  if (mainPending && (announceLeft == 0)) {
+    for (uint8 i=0 ; i<MAIN_MASK_LENGTH ; i++) maskMain[i] = maskNext[i];
+    delta = deltaNext;
+    maskGen = genNext;
+    mainPending = false;
+    keyframe();
+  }
 
 }
 
@@ -8,78 +8,140 @@
 #include "maths.h"
 #include "sensors.h"
 #include "kalman.h"
-#include "SdFat.h"
+#include "sdlog.h"
+#include "telemetry.h"
+#include "framing.h"
+#include "dma.h"
+#include "usart.h"
 
 // Paramètres
 #define BAUD_RATE		19200
+#define PACKET_RATE		24	// Paquets par seconde (période de la tâche LOG)
 
-#define LISTEN_ENABLE		true
-#define LISTEN_INTERVAL		2000
+#define LINK_TIMEOUT		5000	// Le client est considéré connecté s'il a envoyé une commande depuis moins de ... ms
 
-#define MAIN_MASK_LENGTH	10
 #define AUX_MASK_LENGTH		20
 
-// Constantes
-// Masque : chaque information ne peut faire que 8 octets (limitation du buffer)
-#define MASK_END		255
-#define MASK_KEY		0	// 1 octet
-#define MASK_DT			1	// 1 octet
-#define MASK_QUAT_5		2	// 5 octets : 13 bits par coordonnées X,Y,Z et 1 bit de signe pour W (le quaternion est normé)
-#define MASK_QUAT_8		3	// 8 octets : 21 bits     "     "     "     et 1 bit     "     "    "    "    "    "    "
-#define MASK_TEMP		4	// 1 octet
-#define MASK_PRESS		5	// 2 octets
-#define MASK_ALTI		6	// 2 octets
-#define MASK_ACC_6		7
-#define MASK_ACC0_3		8
-#define MASK_ACC0_6		9
-#define MASK_MAG_6		10
-#define MASK_MAG0_3		11
-#define MASK_MAG0_6		12
-#define MASK_GYRZ_6		13
+#define DELTA_ENABLE		false	// Paquet principal en codage différentiel (cf. telemetry.h)
+#define KEYFRAME_INTERVAL	24	// En codage différentiel, une image clé tous les ... paquets
+
+#define SYNC_INTERVAL		1000	// Période d'envoi de la date absolue (ms)
+#define ANNOUNCE_INTERVAL	5000	// Période de répétition de l'annonce du masque principal (ms, cf. framing.h)
+
+// Débit disponible par paquet : 10 bits par octet sur la liaison série (8N1)
+#define SLOT_LENGTH		(BAUD_RATE/10/PACKET_RATE)
+
+#define TX_RING_LENGTH		512	// Tampon circulaire d'émission série (octets)
+#define REPLY_QUEUE		24	// Réponses aux commandes en attente d'envoi (CMD_PERF en produit PROFILE_ZONES + MAX_TASKS + 1)
+
+#define ANNOUNCE_LENGTH		(TM_MASK_WORDS(MAIN_MASK_LENGTH) + 2)	// Réponses d'une annonce du masque principal
+
+// Les champs (codes MASK_..., taille, plage, codage) et les tailles maxi du paquet
+// (MAIN_MASK_LENGTH, AUX_MAX_LENGTH, REPLY_PER_PACKET) sont décrits dans telemetry.h
 
 class LOG {
 private:
   SENSORS *Sensors;
   KALMAN *Kalman;
-  HardwareSPI *Spi;
 
-  uint8 nBuffer;
-  uint64 Buffer; // Buffer de type FIFO
-  uint8 posAux; // Position actuelle dans le masque auxiliaire
+  uint32 auxLast[AUX_MASK_LENGTH]; // Date (millis) du dernier envoi de chaque champ du masque auxiliaire
+  uint8 auxBudget();
+  void writeAux(uint8 budget);
+  uint8 writeReplies();
+
+  // Datation
+  uint32 txTime;	// Date (micros) d'émission du paquet en cours, commune à tous ses champs
+  uint32 syncTime;	// Date (micros) envoyée dans la dernière SYNC
+  uint32 lastSync;	// millis() du dernier envoi de SYNC
+  uint32 syncPacket();
+
+  // Réponses aux commandes du client (file circulaire)
+  uint8 replyCode[REPLY_QUEUE];
+  uint32 replyValue[REPLY_QUEUE][TM_MAX_COUNT];
+  uint8 replyHead, replyTail;
+  uint8 replyUsed();
+  void replyPacket(uint32 *u);
+
+  uint32 tmLast[TM_FIELDS][TM_MAX_COUNT]; // Derniers entiers envoyés dans le paquet principal (référence des écarts)
+  uint8 nKeyframe; // Paquets depuis la dernière image clé
+
+  // Changement du masque principal ou du codage : annoncé au client, puis appliqué (cf. framing.h)
+  boolean mainPending;
+  uint8 announceLeft;	// Réponses à envoyer jusqu'à la fin de l'annonce
+  uint32 lastAnnounce;	// millis() de la dernière annonce
+  void announce();
   
+  // Emission série par DMA : les paquets sont construits dans un tampon circulaire,
+  // dont les plages contiguës sont confiées au DMA
+  uint8 txRing[TX_RING_LENGTH];
+  volatile uint16 txHead;	// Prochain octet à écrire
+  volatile uint16 txTail;	// Prochain octet à émettre
+  volatile uint16 txDmaLen;	// Longueur du transfert DMA en cours (0 : DMA libre)
+  uint16 txFree();
+  void txKick();
+
+  // Le paquet est construit ici, puis mis en trame par sendFrame()
+  uint8 packet[FRAME_HEADER + PACKET_MAX_LENGTH + FRAME_CRC];
+  uint16 nPacket;
+  uint8 seq;
+  void sendFrame();
+
+  // Acquisition de chaque champ (cf. TELEMETRY_FIELDS), indexée par le code
+  typedef void (LOG::*SOURCE)(float *v, uint32 *u);
+#define TM_SOURCE_DECL(name, codec, n, bits, min, max, src)	void source##name(float *v, uint32 *u);
+  TELEMETRY_FIELDS(TM_SOURCE_DECL)
+  static const SOURCE sources[TM_FIELDS];
+
   uint8 write(const uint8 data);
-  uint8 write(const uint64 data, boolean useBuffer, uint8 n=1);
-  uint8 writeBuffer(uint8 n);
-  uint8 writeTab(const float *data, uint8 len, float min, float max, boolean useBuffer, uint8 n=1);
-  uint8 writeData(uint8 b, boolean useBuffer);
+  uint8 writeField(uint8 code, uint8 frame=TM_FRAME_ABS);
+  uint8 encodeField(uint8 code, uint8 *out, uint8 frame=TM_FRAME_ABS);
+  float dtPacket();
+  float jitterPacket();
   
-  uint16 nSync;
-  Sd2Card Card;
-  SdVolume Volume;
-  SdFile Root;
-  SdFile File;
-
   uint8 key;
+  SNAPSHOT Snap; // Etat lu au début de chaque paquet
 
-  boolean enableListen;  
-  boolean isListening;
-  uint32 lastListen;
-  uint32 lastPacket;
   uint32 lastDt;
 
 public:
   LOG(SENSORS *newSensors, KALMAN *newKalman, HardwareSPI *newSpi);
   
   void setup();
-  boolean setupSD();
-  boolean newFile();
   void loop();
   
+  // Débogage seulement : écrit directement sur Serial, au milieu des trames envoyées par le DMA
   void printTab(const char *str, const float* data, uint8 m, uint8 n);
 
-  uint8 maskMain[MAIN_MASK_LENGTH];
+  // Réponse (champ ECHO, ACK, PARAM ou PERF) à envoyer dans les prochains paquets
+  boolean reply(uint8 code, uint32 a=0, uint32 b=0, uint32 c=0, uint32 d=0);
+  uint32 replyDrops;	// Réponses perdues, la file étant pleine
+
+  uint32 lastCommand;	// millis() de la dernière commande valide reçue
+  boolean isLinked();
+
+  void txDone();	// Fin d'un transfert DMA (appelée sous interruption)
+  uint32 txDrops;	// Nombre de trames abandonnées faute de place dans le tampon (le numéro de séquence avance quand même)
+
+  boolean delta;	// Codage différentiel du paquet principal
+  void keyframe();	// Force une image clé au prochain paquet (changement de masque ou de codage)
+  boolean setMain(const uint8 *codes, boolean newDelta);	// Faux si un changement attend encore son annonce, ou si la file des réponses ne peut la contenir
+  void setAux(const uint8 *codes);	// Les champs du nouveau masque repartent sans historique d'envoi
+
+  SDLOG Sd;
+  boolean sdTelemetry;	// Copie des trames sur la carte SD ; faux pendant une capture brute, qui a alors le fichier pour elle seule
+
+  uint8 maskMain[MAIN_MASK_LENGTH];	// Masque en vigueur (MASK_END : aucun champ)
+  uint8 maskNext[MAIN_MASK_LENGTH];	// Masque demandé, égal à maskMain hors changement
+  boolean deltaNext;
+  uint8 maskGen;	// Génération de maskMain, portée par l'en-tête de chaque paquet
+  uint8 genNext;	// Génération de maskNext
   uint8 maskAux[AUX_MASK_LENGTH];
-  uint8 lenAux;
+  uint8 lenAux;		// Taille maxi du paquet auxiliaire, en deçà du débit disponible
+  uint16 mainLength(const uint8 *mask);	// Trame sans paquet auxiliaire (image clé, SYNC comprise)
+
+  // Ordonnancement du paquet auxiliaire, par code de champ
+  uint8 rateAux[TM_FIELDS];	// Fréquence d'envoi visée (Hz), 0 : seulement s'il reste de la place
+  uint8 priorityAux[TM_FIELDS];
   
 };
 
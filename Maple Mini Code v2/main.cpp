@@ -10,25 +10,111 @@
 #include "kalman.h"
 #include "calib.h"
 #include "log.h"
+#include "command.h"
+#include "capture.h"
 #include "pcd8544.h"
 #include "interface.h"
+#include "scheduler.h"
+#include "profile.h"
+
+// Estimateur utilisé au démarrage : FILTER_KALMAN (complet) ou FILTER_MAHONY (faible coût)
+// Il peut être changé à tout moment par myKalman.setMode(...)
+#define FILTER_MODE		FILTER_KALMAN
+
+// Périodes (µs), priorités et échéances (µs) des tâches
+#define IMU_PERIOD		10000	// L'ITG3200 est réglé à 100 Hz ; cadencé par le timer NUM_TIMER
+#define IMU_PRIORITY		0
+#define IMU_DEADLINE		10000
+#define LOG_PRIORITY		1
+#define LOG_DEADLINE		20000
+#define LCD_PRIORITY		2
+#define LCD_DEADLINE		(LCD_PERIOD*1000)
+#define SD_PERIOD		20000	// Un secteur se remplit en ~1 s à 19200 bauds : large marge
+#define SD_PRIORITY		2
+#define SD_DEADLINE		SD_PERIOD
+#define LOW_POWER_FACTOR		8	// En basse consommation, toutes les tâches sont ralenties d'autant
+#define CMD_PERIOD		5000	// Vide le tampon de réception de l'USART et date les pings à 5 ms près
+#define CMD_PRIORITY		3
+#define CMD_DEADLINE		CMD_PERIOD
 
 FLASH myFlash;
 SENSORS mySensors;
-KALMAN myKalman(&mySensors);
+KALMAN myKalman(&mySensors, &myFlash);
 CALIB myCalib(&mySensors, &myFlash);
 HardwareSPI mySpi(NUM_SPI);
 LOG myLog(&mySensors, &myKalman, &mySpi);
 pcd8544 myLcd(PIN_LCD_DC, PIN_LCD_RST, PIN_LCD_SS, &mySpi);
 INTERFACE myInterface(&mySensors, &myKalman, &myCalib, &myLog, &myLcd);
+SCHEDULER myScheduler;
+CAPTURE myCapture(&mySensors, &myLog);
+COMMAND myCommand(&myLog, &myKalman, &myCalib, &myScheduler, &myFlash, &myCapture);
+
+// Tâches
+void setLowPower(boolean low);
+
+void taskImu() {
+  static boolean lowPower = false;
+  PROFILE_BEGIN(PROFILE_SENSORS);
+  boolean ok = mySensors.loop();
+  PROFILE_END(PROFILE_SENSORS);
+  if (ok) myCapture.loop();
+
+  // Pas de basse consommation pendant une capture brute : elle doit rester à pleine cadence,
+  // y compris en attente d'un déclenchement (une chute peut survenir depuis l'immobilité)
+  mySensors.motionChanged = false;
+  boolean low = mySensors.still && (myCapture.mode == CAPTURE_OFF);
+  if (low != lowPower) {
+    lowPower = low;
+    setLowPower(low);
+  }
+  if (myCalib.state != CALIB_OFF) myCalib.loop();
+  else myKalman.loop();
+}
+void taskLog() {
+  PROFILE_BEGIN(PROFILE_LOG);
+  myLog.loop();
+  PROFILE_END(PROFILE_LOG);
+}
+void taskSd() {
+  myLog.Sd.loop();
+}
+void taskLcd() {
+  PROFILE_BEGIN(PROFILE_LCD);
+  myInterface.loop();
+  PROFILE_END(PROFILE_LCD);
+}
+void taskCmd() {
+  myCommand.loop();
+}
+uint8 idImu, idLog, idSd, idLcd, idCmd;
+
+// Top d'échantillonnage (sous interruption)
+void tickImu() { myScheduler.trigger(idImu); }
+
+// Mode basse consommation, piloté par l'activité détectée par l'ADXL345 :
+// capteurs, filtre, LOG et écran sont ralentis ; l'interruption d'activité est lue à chaque
+// échantillon, on revient donc à pleine cadence dès l'échantillon suivant le mouvement.
+// L'immobilité est le bon moment pour sauvegarder le biais gyroscopique s'il a changé.
+void setLowPower(boolean low) {
+  uint32 f = low ? LOW_POWER_FACTOR : 1;
+  if (low) myKalman.save();
+  mySensors.setLowPower(low);
+  mySensors.setupTimer(IMU_PERIOD*f, tickImu);
+  myKalman.setFixedDt(true);
+  myScheduler.setPeriod(idLog, 1000000/PACKET_RATE*f);
+  myScheduler.setPeriod(idLcd, LCD_PERIOD*1000*f);
+}
 
 void setup() {
   mySpi.begin(SPI_9MHZ, MSBFIRST, 0);
+  profileSetup();
   
-  //myFlash.setup();
+  myFlash.setup();
   myLog.setup();
+  myCommand.setup();
   mySensors.setup();
   myKalman.setup();
+  myKalman.setMode(FILTER_MODE);
   myLcd.begin();
   myInterface.setup();
 
@@ -37,22 +123,28 @@ void setup() {
   
   //myFlash.readTf( mySensors.zeroADXL345, FLASH_ZERO_ADXL, 3, mySensors.rangeADXL345 );
   //myFlash.readTf( mySensors.zeroMAG3110, FLASH_ZERO_MAG,  3, mySensors.rangeMAG3110 );
-  //myFlash.readT8( myLog.maskMain, FLASH_MAIN_MASK, MAIN_MASK_LENGTH );
-  //myFlash.readT8( myLog.maskAux,  FLASH_AUX_MASK,  AUX_MASK_LENGTH );
+
+  // Masques enregistrés par le client (CMD_SAVE) ; le principal est annoncé comme un changement
+  if (myFlash.data[FLASH_MASK_VALID] == FLASH_MASK_MAGIC) {
+    uint8 mask[AUX_MASK_LENGTH];
+    myFlash.readT8( mask, FLASH_MAIN_MASK, MAIN_MASK_LENGTH/2 );
+    myLog.setMain( mask, DELTA_ENABLE );
+    myFlash.readT8( mask, FLASH_AUX_MASK, AUX_MASK_LENGTH/2 );
+    myLog.setAux( mask );
+    myLog.lenAux = min(myFlash.data[FLASH_AUX_LENGTH], AUX_MAX_LENGTH);
+  }
+
+  idImu = myScheduler.add(taskImu, "IMU", TASK_TRIGGERED, IMU_PRIORITY, IMU_DEADLINE);
+  idLog = myScheduler.add(taskLog, "LOG", 1000000/PACKET_RATE, LOG_PRIORITY, LOG_DEADLINE);
+  idSd  = myScheduler.add(taskSd,  "SD",  SD_PERIOD, SD_PRIORITY, SD_DEADLINE);
+  idLcd = myScheduler.add(taskLcd, "LCD", LCD_PERIOD*1000, LCD_PRIORITY, LCD_DEADLINE);
+  idCmd = myScheduler.add(taskCmd, "CMD", CMD_PERIOD, CMD_PRIORITY, CMD_DEADLINE);
+
+  // Echantillonnage à cadence exacte, filtre à pas de temps constant
+  mySensors.setupTimer(IMU_PERIOD, tickImu);
+  myKalman.setFixedDt(true);
 }
 
 void loop() {
-  //myLog.printTab("ADXL", mySensors.measureADXL345, 1, 3);
-  //myLog.printTab("ITG", mySensors.measureITG3200, 1, 3);
-  //myLog.printTab("MAG", mySensors.measureMAG3110, 1, 3);
-  myLog.printTab("Orient", myKalman.Cardan, 1, 3);
-  myLog.printTab("ADXL_0", myKalman.measureADXL345_0, 1, 3);
-  Serial.println();
-
-  mySensors.loop();
-  if (myCalib.state != CALIB_OFF) myCalib.loop();
-  else myKalman.loop();
-  //myLog.loop();
-  myInterface.loop();
+  myScheduler.loop();
 }
-
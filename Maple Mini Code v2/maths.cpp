@@ -154,7 +154,7 @@ float Norm2V(float *vect) {
 }
 
 float NormV(float *vect) {
-  return sqrt( Norm2V(vect) );
+  return fastSqrt( Norm2V(vect) );
 }
 
 float PrdSV(float *A, float *B) {
@@ -181,9 +181,97 @@ float DLcos(float x) {
 }
 
 void CalcCardan(float *res, float* Q) {
-  res[0] = atan2( 2* (Q[1]*Q[2]+Q[3]*Q[0]) ,1-2*(sq(Q[2])+sq(Q[3]))) *CDR;	// Lacet
-  res[1] = asin(  2* (Q[0]*Q[2]-Q[1]*Q[3]))			     *CDR;	// Roulis
-  res[2] = atan2( 2* (Q[0]*Q[1]+Q[2]*Q[3]) ,1-2*(sq(Q[1])+sq(Q[2]))) *CDR;	// Tangage
+  res[0] = fastAtan2( 2* (Q[1]*Q[2]+Q[3]*Q[0]) ,1-2*(sq(Q[2])+sq(Q[3]))) *CDR;	// Lacet
+  res[1] = fastAsin(  2* (Q[0]*Q[2]-Q[1]*Q[3]))			         *CDR;	// Roulis
+  res[2] = fastAtan2( 2* (Q[0]*Q[1]+Q[2]*Q[3]) ,1-2*(sq(Q[1])+sq(Q[2]))) *CDR;	// Tangage
+}
+
+// Projection de la gravité et du champ magnétique terrestres dans le repère de la centrale
+// (c'est-à-dire les mesures attendues de l'ADXL345 et du MAG3110)
+void CalcProj(float *ADXL345_0, float *MAG3110_0, float *Q) {
+  float uZ[3] = {
+    2*(Q[1]*Q[3]-Q[0]*Q[2]),
+    2*(Q[2]*Q[3]+Q[0]*Q[1]),
+    sq(Q[0])-sq(Q[1])-sq(Q[2])+sq(Q[3]) };
+  float uX[3] = {
+    sq(Q[0])+sq(Q[1])-sq(Q[2])-sq(Q[3]),
+    2*(Q[1]*Q[2]-Q[0]*Q[3]),
+    2*(Q[1]*Q[3]+Q[0]*Q[2]) };
+
+  Comb2M(uZ, 9.81, uX, 0, 3, 1, ADXL345_0);
+  Comb2M(uZ, 43.23, uX, -20.74, 3, 1, MAG3110_0);
+}
+
+
+
+// * * * * * * * * * * * *
+//  Q U A T E R N I O N S
+// * * * * * * * * * * * *
+
+// W est exprimé dans le repère de la centrale
+void DerQ(float *dQ, float *Q, float *W) {
+  dQ[0] = ( - Q[1]*W[0] - Q[2]*W[1] - Q[3]*W[2] ) / 2;
+  dQ[1] = (   Q[0]*W[0] + Q[2]*W[2] - Q[3]*W[1] ) / 2;
+  dQ[2] = (   Q[0]*W[1] - Q[1]*W[2] + Q[3]*W[0] ) / 2;
+  dQ[3] = (   Q[0]*W[2] + Q[1]*W[1] - Q[2]*W[0] ) / 2;
+}
+
+void NormQ(float *Q) {
+  float n = sq(Q[0]) + sq(Q[1]) + sq(Q[2]) + sq(Q[3]);
+  if (n == 0) return;
+  n = fastInvSqrt(n);
+  for (uint8 i=0 ; i<4 ; i++) Q[i] *= n;
+}
+
+void PrdQ(float *res, float *A, float *B) {
+  res[0] = A[0]*B[0] - A[1]*B[1] - A[2]*B[2] - A[3]*B[3];
+  res[1] = A[0]*B[1] + A[1]*B[0] + A[2]*B[3] - A[3]*B[2];
+  res[2] = A[0]*B[2] - A[1]*B[3] + A[2]*B[0] + A[3]*B[1];
+  res[3] = A[0]*B[3] + A[1]*B[2] - A[2]*B[1] + A[3]*B[0];
+}
+
+// On compose Q avec le quaternion de rotation d'angle |W|dt autour de W (repère de la centrale)
+// res doit être différent de Q
+void IntegQ(float *res, float *Q, float *W, float dt) {
+  float a = NormV(W) * dt / 2;
+  float s = (a > 0.0001) ? sin(a) / NormV(W) : dt / 2; // sin(a)/|W| -> dt/2 quand a -> 0
+  float R[4] = { cos(a), s*W[0], s*W[1], s*W[2] };
+  PrdQ(res, Q, R);
+}
+
+// Méthode de Shepperd : on divise par le plus grand des termes pour rester stable numériquement
+void QuatFromM(float *Q, float *M) {
+  float tr = M[0] + M[4] + M[8];
+  float s;
+  if (tr > 0) {
+    s = 2*sqrt(1+tr);
+    Q[0] = s/4;
+    Q[1] = (M[7]-M[5])/s;
+    Q[2] = (M[2]-M[6])/s;
+    Q[3] = (M[3]-M[1])/s;
+  }
+  else if ((M[0] > M[4]) && (M[0] > M[8])) {
+    s = 2*sqrt(1+M[0]-M[4]-M[8]);
+    Q[0] = (M[7]-M[5])/s;
+    Q[1] = s/4;
+    Q[2] = (M[1]+M[3])/s;
+    Q[3] = (M[2]+M[6])/s;
+  }
+  else if (M[4] > M[8]) {
+    s = 2*sqrt(1-M[0]+M[4]-M[8]);
+    Q[0] = (M[2]-M[6])/s;
+    Q[1] = (M[1]+M[3])/s;
+    Q[2] = s/4;
+    Q[3] = (M[5]+M[7])/s;
+  }
+  else {
+    s = 2*sqrt(1-M[0]-M[4]+M[8]);
+    Q[0] = (M[3]-M[1])/s;
+    Q[1] = (M[2]+M[6])/s;
+    Q[2] = (M[5]+M[7])/s;
+    Q[3] = s/4;
+  }
+  if (Q[0] < 0) for (uint8 i=0 ; i<4 ; i++) Q[i] = -Q[i];
 }
 
 
@@ -212,6 +300,6 @@ uint64 ftoi(const float value, float min, float max, uint8 n) {
 }
 
 float itof(const uint64 value, float min, float max, uint8 n) {
-  return (float)(value/((1<<n)-1)) * (max-min) + min;
+  return (float)value/((1<<n)-1) * (max-min) + min;
 }
 
@@ -5,6 +5,7 @@
 #define _MATHS_H_
 
 #include "wirish.h"
+#include "fastmath.h"
 
 // Conversion degrés/radians
 const float CDR = 57.295779513;
@@ -36,6 +37,14 @@ float PrdSV(float *A, float *B); // Produit scalaire de deux vecteurs 3D
 void PrdVV(float *res, float *A, float *B); // Produit vectoriel
 void RotV(float *vect, float axeX, float axeY, float axeZ, float c, float s); // Rotation vectorielle 3D
 void CalcCardan(float *res, float* Q); // Angles de Cardan associés à un quaternion
+void CalcProj(float *ADXL345_0, float *MAG3110_0, float *Q); // Gravité et champ terrestre vus de la centrale
+
+// Opérations sur les quaternions
+void DerQ(float *dQ, float *Q, float *W); // Dérivée dQ = Q*(0,W)/2 d'un quaternion soumis à une vitesse de rotation W
+void NormQ(float *Q); // Normalise un quaternion
+void PrdQ(float *res, float *A, float *B); // Produit de deux quaternions res=AB
+void IntegQ(float *res, float *Q, float *W, float dt); // Rotation de Q à la vitesse W (constante) pendant dt
+void QuatFromM(float *Q, float *M); // Quaternion associé à une matrice de rotation 3x3
 
 
 float DLcos(float x);
@@ -6,7 +6,12 @@
 
 #define I2C			I2C2
 #define Serial			Serial2
+#define SERIAL_USART		USART2_BASE	// USART de Serial, pour l'émission par DMA
+#define SERIAL_DMA_CH		DMA_CH7		// Canal DMA1 associé à USART2_TX
 #define NUM_SPI			2
+#define NUM_TIMER		3	// Timer d'échantillonnage des capteurs
+
+#define PIN_SERIAL_RX		8	// RX de Serial2 (PA3), aussi surveillé par EXTI pour dater les commandes
 
 #define PIN_LCD_LED		12
 #define PIN_LCD_DC		7
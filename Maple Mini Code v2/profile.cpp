@@ -0,0 +1,46 @@
+// Mesure du temps d'exécution de zones de code, au cycle près
+// Matthias Lemainque 2013
+
+#include "profile.h"
+
+struct PROFILE_ZONE {
+  uint32_t n;
+  uint32_t min, max;
+  uint64_t sum;
+};
+
+static PROFILE_ZONE zones[PROFILE_ZONES];
+
+void profileSetup() {
+#if defined(__arm__)
+  DEMCR |= DEMCR_TRCENA;
+  DWT_CYCCNT = 0;
+  DWT_CTRL |= DWT_CTRL_CYCCNTENA;
+#endif
+  profileReset();
+}
+
+void profileReset() {
+  for (uint8_t i=0 ; i<PROFILE_ZONES ; i++) {
+    zones[i].n = 0;
+    zones[i].min = 0xFFFFFFFF;
+    zones[i].max = 0;
+    zones[i].sum = 0;
+  }
+}
+
+void profileAdd(uint8_t zone, uint32_t cycles) {
+  PROFILE_ZONE *z = &zones[zone];
+  z->n++;
+  z->sum += cycles;
+  if (cycles < z->min) z->min = cycles;
+  if (cycles > z->max) z->max = cycles;
+}
+
+void profileStats(uint8_t zone, uint32_t *n, uint32_t *min, uint32_t *avg, uint32_t *max) {
+  PROFILE_ZONE *z = &zones[zone];
+  *n = z->n;
+  *min = z->n ? z->min : 0;
+  *avg = z->n ? (uint32_t)(z->sum / z->n) : 0;
+  *max = z->max;
+}
@@ -0,0 +1,56 @@
+// Mesure du temps d'exécution de zones de code, au cycle près
+// Matthias Lemainque 2013
+
+#ifndef _PROFILE_H_
+#define _PROFILE_H_
+
+#include <stdint.h>
+
+// Paramètres
+#define PROFILE_ENABLE		1	// 0 : les macros ne génèrent aucun code
+
+// Constantes
+// Zones mesurées
+#define PROFILE_SENSORS		0
+#define PROFILE_GENA		1
+#define PROFILE_PREDICT		2
+#define PROFILE_GENH		3
+#define PROFILE_UPDATE		4
+#define PROFILE_LOG		5
+#define PROFILE_LCD		6
+#define PROFILE_ZONES		7
+
+// Sur la cible, on lit le compteur de cycles DWT_CYCCNT du Cortex-M3 (72 MHz)
+// Sur l'ordinateur, on utilise clock_gettime : l'unité est alors la nanoseconde
+#if defined(__arm__)
+#define DEMCR			(*(volatile uint32_t*)0xE000EDFC)
+#define DEMCR_TRCENA		(1<<24)
+#define DWT_CTRL		(*(volatile uint32_t*)0xE0001000)
+#define DWT_CTRL_CYCCNTENA	(1<<0)
+#define DWT_CYCCNT		(*(volatile uint32_t*)0xE0001004)
+#define PROFILE_CYCLES_PER_US	72
+static inline uint32_t profileCycles() { return DWT_CYCCNT; }
+#else
+#include <time.h>
+#define PROFILE_CYCLES_PER_US	1000
+static inline uint32_t profileCycles() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint32_t)(ts.tv_sec*1000000000ULL + ts.tv_nsec);
+}
+#endif
+
+#if PROFILE_ENABLE
+#define PROFILE_BEGIN(zone)	uint32_t _profile_##zone = profileCycles()
+#define PROFILE_END(zone)	profileAdd(zone, profileCycles() - _profile_##zone)
+#else
+#define PROFILE_BEGIN(zone)
+#define PROFILE_END(zone)
+#endif
+
+void profileSetup();
+void profileAdd(uint8_t zone, uint32_t cycles);
+void profileReset();
+void profileStats(uint8_t zone, uint32_t *n, uint32_t *min, uint32_t *avg, uint32_t *max); // Sans remise à zéro
+
+#endif // _PROFILE_H_
@@ -0,0 +1,160 @@
+// Ordonnanceur coopératif : périodes, priorités, échéances et statistiques par tâche
+// Matthias Lemainque 2013
+
+#include "scheduler.h"
+
+SCHEDULER::SCHEDULER() {
+  nTasks = 0;
+  startStats = 0;
+  enableIdle = true;
+}
+
+// Renvoit l'identifiant de la tâche, ou TASK_NONE s'il n'y a plus de place
+uint8 SCHEDULER::add(TASK_FUNC func, const char *name, uint32 period, uint8 priority, uint32 deadline) {
+  if (nTasks >= MAX_TASKS) return TASK_NONE;
+  TASK *t = &tasks[nTasks];
+  t->func = func;
+  t->name = name;
+  t->period = period;
+  t->priority = priority;
+  t->deadline = deadline;
+  t->next = micros();
+  t->triggered = false;
+  return nTasks++;
+}
+
+void SCHEDULER::trigger(uint8 id) {
+  if (id >= nTasks) return;
+  tasks[id].triggerTime = micros();
+  tasks[id].triggered = true;
+}
+
+void SCHEDULER::setPeriod(uint8 id, uint32 period) {
+  if (id >= nTasks) return;
+  tasks[id].next += (int32)(period - tasks[id].period);
+  tasks[id].period = period;
+}
+
+void SCHEDULER::resetStats() {
+  for (uint8 i=0 ; i<nTasks ; i++) {
+    tasks[i].nRun = 0;
+    tasks[i].nOverrun = 0;
+    tasks[i].jitterSum = 0;
+    tasks[i].jitterMax = 0;
+    tasks[i].timeSum = 0;
+    tasks[i].timeMax = 0;
+  }
+  idleSum = 0;
+  nIdle = 0;
+  startStats = micros();
+}
+
+boolean SCHEDULER::taskStats(uint8 id, uint32 *nOverrun, uint32 *jitterAvg, uint32 *jitterMax, uint32 *share) {
+  if (id >= nTasks) return false;
+  TASK *t = &tasks[id];
+  float elapsed = micros() - startStats;
+  *nOverrun = t->nOverrun;
+  *jitterAvg = t->jitterSum / max(t->nRun, 1);
+  *jitterMax = t->jitterMax;
+  *share = (elapsed > 0) ? 1000 * t->timeSum / elapsed : 0;
+  return true;
+}
+
+
+//  * * * * * * * * * * * * * *
+// O R D O N N A N C E M E N T
+//  * * * * * * * * * * * * * *
+
+// Tâche prête la plus prioritaire ; à priorité égale, celle dont la date prévue est la plus ancienne
+uint8 SCHEDULER::ready(uint32 time) {
+  uint8 best = TASK_NONE;
+  for (uint8 i=0 ; i<nTasks ; i++) {
+    if (tasks[i].period == TASK_TRIGGERED) {
+      if (!tasks[i].triggered) continue;
+      tasks[i].next = tasks[i].triggerTime;
+    }
+    else if ((int32)(time - tasks[i].next) < 0) continue; // Pas encore à l'heure (la soustraction gère l'overflow)
+    if ((best == TASK_NONE) || (tasks[i].priority < tasks[best].priority)
+      || ((tasks[i].priority == tasks[best].priority) && ((int32)(tasks[i].next - tasks[best].next) < 0)))
+      best = i;
+  }
+  return best;
+}
+
+void SCHEDULER::run(uint8 id) {
+  TASK *t = &tasks[id];
+  t->triggered = false;
+  uint32 start = micros();
+  t->func();
+  uint32 end = micros();
+
+  uint32 jitter = start - t->next;
+  uint32 time = end - start;
+  t->nRun++;
+  t->jitterSum += jitter;
+  t->timeSum += time;
+  if (jitter > t->jitterMax) t->jitterMax = jitter;
+  if (time > t->timeMax) t->timeMax = time;
+  if ((int32)(end - t->next - t->deadline) > 0) t->nOverrun++;
+
+  // Si on a raté plus d'une période, on se recale plutôt que d'enchaîner les exécutions en retard
+  if (t->period == TASK_TRIGGERED) return;
+  t->next += t->period;
+  if ((int32)(end - t->next) > 0) t->next = end;
+}
+
+// Exécute au plus une tâche : la boucle principale reste réactive aux tâches plus prioritaires
+// S'il n'y a rien à faire, on met le coeur en veille jusqu'à la prochaine échéance
+void SCHEDULER::loop() {
+  if (startStats == 0) resetStats();
+  uint32 time = micros();
+  uint8 id = ready(time);
+  if (id != TASK_NONE) run(id);
+  else if (enableIdle) idle(time);
+}
+
+
+//  * * * * * *
+// V E I L L E
+//  * * * * * *
+
+// Délai (µs) avant la prochaine tâche périodique ; les tâches déclenchées nous réveillent d'elles-mêmes
+uint32 SCHEDULER::nextDue(uint32 time) {
+  uint32 delay = 0xFFFFFFFF;
+  for (uint8 i=0 ; i<nTasks ; i++) {
+    if (tasks[i].period == TASK_TRIGGERED) continue;
+    int32 d = (int32)(tasks[i].next - time);
+    if (d <= 0) return 0;
+    if ((uint32)d < delay) delay = d;
+  }
+  return delay;
+}
+
+// WFI arrête l'horloge du coeur jusqu'à la prochaine interruption : SysTick (toutes les ms),
+// timer d'échantillonnage, réception série... On se rendort tant qu'aucune tâche n'est prête.
+// Le test et WFI se font interruptions masquées : un trigger() arrivé entre les deux laisse
+// son interruption en attente, et WFI rend la main aussitôt au lieu de dormir jusqu'au SysTick
+// suivant. L'interruption est servie au démasquage.
+void SCHEDULER::idle(uint32 time) {
+  uint32 start = time;
+  boolean slept = false;
+  while (true) {
+    asm volatile("cpsid i" ::: "memory");
+    time = micros();
+    if ((ready(time) != TASK_NONE) || (nextDue(time) < IDLE_MIN)) break;
+    asm volatile("wfi");
+    asm volatile("cpsie i" ::: "memory");
+    slept = true;
+  }
+  asm volatile("cpsie i" ::: "memory");
+  if (!slept) return;
+  nIdle++;
+  idleSum += time - start;
+}
+
+float SCHEDULER::dutyCycle() {
+  float elapsed = micros() - startStats;
+  if (elapsed <= 0) return 1;
+  return 1 - idleSum / elapsed;
+}
+
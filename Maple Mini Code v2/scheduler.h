@@ -0,0 +1,67 @@
+// Ordonnanceur coopératif : périodes, priorités, échéances et statistiques par tâche
+// Matthias Lemainque 2013
+
+#ifndef _SCHEDULER_H_
+#define _SCHEDULER_H_
+
+#include "wirish.h"
+#include "pins.h"
+
+// Paramètres
+#define MAX_TASKS		8
+#define IDLE_MIN		50	// En dessous de ce délai (µs) avant la prochaine tâche, on ne dort pas
+
+// Constantes
+#define TASK_NONE		255
+#define TASK_TRIGGERED		0	// Période d'une tâche déclenchée uniquement par trigger()
+
+typedef void (*TASK_FUNC)();
+
+struct TASK {
+  TASK_FUNC func;
+  const char *name;
+  uint32 period;	// Période (µs)
+  uint32 deadline;	// Echéance, comptée depuis la date prévue (µs)
+  uint8 priority;	// 0 : priorité la plus haute
+  uint32 next;		// Date prévue de la prochaine exécution (micros)
+  volatile boolean triggered;	// Déclenchement demandé (éventuellement sous interruption)
+  volatile uint32 triggerTime;
+
+  // Statistiques
+  uint32 nRun;
+  uint32 nOverrun;	// Nombre d'exécutions terminées après l'échéance
+  uint32 jitterSum, jitterMax;	// Retard au démarrage (µs)
+  uint32 timeSum, timeMax;	// Durée d'exécution (µs)
+};
+
+class SCHEDULER {
+private:
+  TASK tasks[MAX_TASKS];
+  uint8 nTasks;
+  uint32 startStats;
+
+  uint8 ready(uint32 time);
+  void run(uint8 id);
+
+  // Veille du coeur (WFI) entre deux tâches
+  uint32 nextDue(uint32 time);
+  void idle(uint32 time);
+  uint32 idleSum;	// Temps passé en veille (µs)
+  uint32 nIdle;		// Nombre de mises en veille
+
+public:
+  SCHEDULER();
+
+  uint8 add(TASK_FUNC func, const char *name, uint32 period, uint8 priority, uint32 deadline);
+  void setPeriod(uint8 id, uint32 period);
+  void trigger(uint8 id); // Peut être appelée sous interruption
+  void loop();
+  boolean enableIdle;
+
+  float dutyCycle();	// Fraction du temps passée hors veille depuis la dernière remise à zéro
+
+  void resetStats();
+  boolean taskStats(uint8 id, uint32 *nOverrun, uint32 *jitterAvg, uint32 *jitterMax, uint32 *share);	// share en ‰ ; faux si la tâche n'existe pas
+};
+
+#endif // _SCHEDULER_H_
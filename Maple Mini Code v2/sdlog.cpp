@@ -0,0 +1,146 @@
+// Enregistrement sur carte SD par secteurs entiers dans un fichier contigu préalloué
+// Matthias Lemainque 2013
+
+#include "sdlog.h"
+
+// Le fichier est créé d'un bloc : on l'écrit ensuite secteur par secteur par une écriture
+// multi-secteurs brute, sans jamais toucher à la FAT ni au répertoire. Ceux-ci ne sont mis à
+// jour qu'à la fermeture (taille réelle du fichier). Après une coupure, la fin des données est
+// repérée par les secteurs effacés qui suivent : l'effacement se fait par tranches de
+// SD_ERASE_CHUNK secteurs en avance sur l'écriture, plutôt que d'un bloc à l'ouverture, qui
+// bloquait l'ordonnanceur le temps d'effacer tout le fichier.
+// Au contraire, File.write()/File.sync() réécrivaient FAT et répertoire tous les 512
+// octets et bloquaient le bus SPI partagé avec l'écran pendant plusieurs ms.
+
+SDLOG::SDLOG(HardwareSPI *newSpi) {
+  Spi = newSpi;
+  overruns = 0;
+  newFile = false;
+  prefix = SD_PREFIX_LOG;
+}
+
+boolean SDLOG::setup() {
+  if (!Root.isOpen()) {
+    if (!Card.init(Spi)) return false;
+    delay(100);
+    if (!Volume.init(&Card)) return false;
+    if (!Root.openRoot(&Volume)) return false;
+  }
+  return true;
+}
+
+boolean SDLOG::isOpen() {
+  return File.isOpen();
+}
+
+boolean SDLOG::open(const char *newPrefix) {
+  if (File.isOpen() && !close()) return false;
+
+  if (newPrefix != NULL) prefix = newPrefix;
+  char name[12] = "LOG_000.BIN";
+  for (uint8 i=0 ; i<3 ; i++) name[i] = prefix[i];
+  for (uint16 i=0 ; i<1000 ; i++) {
+    name[4] = '0' + i/100;
+    name[5] = '0' + (i/10)%10;
+    name[6] = '0' + i%10;
+    if (File.createContiguous(&Root, name, SD_FILE_SIZE)) break;
+    if (i == 999) return false;
+  }
+
+  if (!File.contiguousRange(&bgnBlock, &endBlock)) return false;
+  eraseBlock = bgnBlock;
+  curBlock = bgnBlock;
+  if (!eraseNext()) return false;
+  if (!Card.writeStart(bgnBlock, endBlock-bgnBlock+1)) return false;
+
+  nBytes = 0;
+  bufWrite = 0;
+  bufFlush = 0;
+  nFull = 0;
+  pos = 0;
+  lastCheckpoint = millis();
+  newFile = true;
+  return true;
+}
+
+// Le dernier secteur incomplet est complété par des zéros ; la taille du fichier est ramenée
+// au nombre d'octets réellement reçus. Les tampons sont écrits directement, sans passer par
+// loop() qui ouvrirait un nouveau fichier si celui-ci est plein.
+boolean SDLOG::close() {
+  if (!File.isOpen()) return true;
+  if (pos > 0) {
+    for (uint16 i=pos ; i<SD_BLOCK ; i++) buffer[bufWrite][i] = 0;
+    nFull++;
+    pos = 0;
+  }
+  flush();
+  if (nFull > 0) { // Fichier plein : le reste est perdu
+    nBytes = SD_FILE_SIZE;
+    nFull = 0;
+  }
+  if (!Card.writeStop()) return false;
+  if (!File.truncate(nBytes)) return false;
+  return File.close();
+}
+
+void SDLOG::write(const uint8 data) {
+  if (!File.isOpen()) return;
+  if (nFull >= SD_BUFFERS) {
+    overruns++;
+    return;
+  }
+  buffer[bufWrite][pos++] = data;
+  nBytes++;
+  if (pos == SD_BLOCK) {
+    pos = 0;
+    nFull++;
+    bufWrite = (bufWrite + 1) % SD_BUFFERS;
+  }
+}
+
+// L'écriture a consommé la moitié de la dernière tranche effacée
+boolean SDLOG::eraseDue() {
+  return (eraseBlock <= endBlock) && (eraseBlock - curBlock < SD_ERASE_CHUNK/2);
+}
+
+// Hors écriture multi-secteurs seulement
+boolean SDLOG::eraseNext() {
+  uint32 last = min(eraseBlock + SD_ERASE_CHUNK, endBlock + 1) - 1;
+  if (!Card.erase(eraseBlock, last)) return false;
+  eraseBlock = last + 1;
+  return true;
+}
+
+// On termine l'écriture multi-secteurs en cours, ce qui oblige la carte à valider les
+// secteurs déjà reçus, on efface si besoin la tranche suivante, puis on recommence une
+// écriture au secteur suivant
+boolean SDLOG::checkpoint() {
+  lastCheckpoint = millis();
+  if (!Card.writeStop()) return false;
+  if (eraseDue() && !eraseNext()) return false;
+  return Card.writeStart(curBlock, endBlock-curBlock+1);
+}
+
+// Ecrit les tampons pleins, sans dépasser la fin du fichier ni la partie effacée
+void SDLOG::flush() {
+  while ((nFull > 0) && (curBlock <= endBlock)) {
+    if ((curBlock >= eraseBlock) && !checkpoint()) return;
+    if (!Card.writeData(buffer[bufFlush])) return;
+    curBlock++;
+    bufFlush = (bufFlush + 1) % SD_BUFFERS;
+    nFull--;
+  }
+}
+
+void SDLOG::loop() {
+  if (!File.isOpen()) return;
+  flush();
+  if (nFull > 0) {
+    if (curBlock <= endBlock) return; // Erreur de la carte : on réessaiera
+    // Fichier plein : on en ouvre un autre
+    close();
+    open();
+    return;
+  }
+  if ((millis()-lastCheckpoint > SD_CHECKPOINT) || eraseDue()) checkpoint();
+}
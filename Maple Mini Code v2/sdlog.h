@@ -0,0 +1,63 @@
+// Enregistrement sur carte SD par secteurs entiers dans un fichier contigu préalloué
+// Matthias Lemainque 2013
+
+#ifndef _SDLOG_H_
+#define _SDLOG_H_
+
+#include "wirish.h"
+#include "SdFat.h"
+
+// Paramètres
+#define SD_FILE_SIZE		(64UL*1024*1024)	// Taille préallouée de chaque fichier (octets)
+#define SD_CHECKPOINT		10000	// Période de validation des écritures sur la carte (ms)
+#define SD_ERASE_CHUNK		1024	// Secteurs effacés d'un coup devant l'écriture (512 ko)
+
+// Constantes
+#define SD_BLOCK		512	// Taille d'un secteur
+#define SD_BUFFERS		4	// Nombre de tampons d'un secteur : ~0.7 s de latence de la carte en capture brute
+#define SD_PREFIX_LOG		"LOG"	// Préfixe (3 lettres) des fichiers de télémétrie
+#define SD_PREFIX_RAW		"RAW"	// Préfixe des fichiers de capture brute
+
+class SDLOG {
+private:
+  HardwareSPI *Spi;
+  Sd2Card Card;
+  SdVolume Volume;
+  SdFile Root;
+  SdFile File;
+
+  // Tampons d'un secteur : on remplit l'un pendant que l'autre attend d'être écrit
+  uint8 buffer[SD_BUFFERS][SD_BLOCK];
+  uint8 bufWrite;	// Tampon en cours de remplissage
+  uint8 bufFlush;	// Prochain tampon à écrire sur la carte
+  uint8 nFull;		// Nombre de tampons pleins
+  uint16 pos;		// Position dans le tampon en cours de remplissage
+
+  uint32 bgnBlock, endBlock;	// Secteurs du fichier contigu
+  uint32 curBlock;		// Prochain secteur à écrire
+  uint32 eraseBlock;		// Premier secteur pas encore effacé
+  uint32 nBytes;		// Octets reçus depuis l'ouverture
+  uint32 lastCheckpoint;
+  const char *prefix;
+
+  boolean checkpoint();
+  boolean eraseDue();
+  boolean eraseNext();
+  void flush();
+
+public:
+  SDLOG(HardwareSPI *newSpi);
+
+  boolean setup();
+  boolean open(const char *newPrefix = NULL);	// NULL : même préfixe que le fichier précédent
+  boolean close();
+  boolean isOpen();
+
+  void write(const uint8 data);
+  void loop(); // Ecrit les secteurs pleins : à appeler régulièrement par l'ordonnanceur
+
+  uint32 overruns; // Octets perdus car tous les tampons étaient pleins
+  boolean newFile; // Un fichier vient d'être ouvert (éventuellement parce que le précédent était plein)
+};
+
+#endif // _SDLOG_H_
@@ -3,6 +3,18 @@
 
 #include "sensors.h"
 
+// Top d'échantillonnage : les variables partagées avec l'interruption sont statiques
+static HardwareTimer sampleTimer(NUM_TIMER);
+static volatile uint32 tickTime;
+static volatile uint32 tickCount;	// Tops depuis le démarrage : le loop() qui en a manqué les compte
+static voidFuncPtr tickHandler = NULL;
+
+static void sensorsTick() {
+  tickTime = micros();
+  tickCount++;
+  if (tickHandler != NULL) tickHandler();
+}
+
 //  * * * * * * * * * * *
 // C O N S T R U C T E U R
 //  * * * * * * * * * * *
@@ -13,10 +25,28 @@ SENSORS::SENSORS() {
 
   // Référence de pression/altitude
   refAlt = 0;
-  refPress = 10132.5;
+  refPress = 101325; // Pa
+
+  // Température absurde tant que le BMP085 n'a pas été lu
+  temperature = TEMPERATURE_UNKNOWN;
   
   // Par défaut, on utilise les zéros
   enableZeros = true;
+
+  // Par défaut, dt est mesuré après coup
+  fixedDt = false;
+  samplePeriod = 0;
+  ticks = 1;
+  missedTicks = 0;
+  lastCount = 0;
+  still = false;
+  motionChanged = false;
+  latency = 0;
+  latencyMax = 0;
+  latencyPeak = 0;
+  latencyStart = 0;
+  rawBMP085 = 0;
+  intADXL345 = 0;
 }
 
 
@@ -33,6 +63,33 @@ void SENSORS::setup() {
   lastLoop = micros();
 }
 
+// Change la fréquence d'échantillonnage des trois capteurs inertiels
+void SENSORS::setLowPower(boolean low) {
+  this->write(ADXL_ADDR, BW_RATE, low ? ADXL_RATE_LOW : ADXL_RATE_FULL);
+  this->write(ITG_ADDR, SMPLRT_DIV, low ? ITG_DIV_LOW : ITG_DIV_FULL);
+  // Le MAG3110 doit être en veille pour changer de fréquence
+  this->write(MAG_ADDR, MAG_CTRL_REG1, 0);
+  this->write(MAG_ADDR, MAG_CTRL_REG1, ((low ? MAG_DR_LOW : MAG_DR_FULL) << MAG_DR0) | (1 << MAG_AC));
+}
+
+void SENSORS::setupTimer(uint32 period, voidFuncPtr handler) {
+  sampleTimer.pause();
+  samplePeriod = period;
+  fixedDt = (period > 0);
+  if (!fixedDt) return;
+
+  dt = (float)period / 1000000;
+  tickHandler = handler;
+  tickTime = micros();
+  lastCount = tickCount;
+  sampleTimer.setPeriod(period);
+  sampleTimer.setChannel1Mode(TIMER_OUTPUT_COMPARE);
+  sampleTimer.setCompare(TIMER_CH1, 1); // Interruption à chaque débordement
+  sampleTimer.attachCompare1Interrupt(sensorsTick);
+  sampleTimer.refresh();
+  sampleTimer.resume();
+}
+
 void SENSORS::setupI2C() {
   i2c_master_enable(I2C, 0);
   delay(500);
@@ -40,20 +97,34 @@ void SENSORS::setupI2C() {
 }
 
 void SENSORS::setupADXL345() {
-  this->write(ADXL_ADDR, POWER_CTL, MEASURE);
   this->write(ADXL_ADDR, DATA_FORMAT, 0); // +/- 2g
+  this->write(ADXL_ADDR, BW_RATE, ADXL_RATE_FULL);
+
+  // Détection d'activité/inactivité sur les 3 axes, en couplage AC (insensible à la gravité)
+  this->write(ADXL_ADDR, THRESH_ACT, ADXL_THRESH_ACT);
+  this->write(ADXL_ADDR, THRESH_INACT, ADXL_THRESH_INACT);
+  this->write(ADXL_ADDR, TIME_INACT, ADXL_TIME_INACT);
+  this->write(ADXL_ADDR, ACT_INACT_CTL, 0xFF);
+
+  // Chute libre : interruption lue par CAPTURE comme déclencheur
+  this->write(ADXL_ADDR, THRESH_FF, ADXL_THRESH_FF);
+  this->write(ADXL_ADDR, TIME_FF, ADXL_TIME_FF);
+  this->write(ADXL_ADDR, INT_ENABLE, ACTIVITY | INACTIVITY | FREE_FALL);
+
+  // LINK : l'activité n'est signalée qu'après une inactivité, et réciproquement
+  this->write(ADXL_ADDR, POWER_CTL, LINK | MEASURE);
   rangeADXL345 = 2*9.81; // m/s² / lb
 }
 
 void SENSORS::setupMAG3110() {
   this->write(MAG_ADDR, MAG_CTRL_REG2, (1 << MAG_AUTO_MRST_EN)); // enabled auto reset
-  this->write(MAG_ADDR, MAG_CTRL_REG1, (1 << MAG_AC)); // active mode
+  this->write(MAG_ADDR, MAG_CTRL_REG1, (MAG_DR_FULL << MAG_DR0) | (1 << MAG_AC)); // active mode
   rangeMAG3110 = 512*0.1; // uT / lb
 }
 
 void SENSORS::setupITG3200() {
   this->write(ITG_ADDR, DLPF_FS, DLPF_FS_SEL_0|DLPF_FS_SEL_1|DLPF_CFG_0); // +/- 2000°/s
-  this->write(ITG_ADDR, SMPLRT_DIV, 9);
+  this->write(ITG_ADDR, SMPLRT_DIV, ITG_DIV_FULL);
   this->write(ITG_ADDR, INT_CFG, INT_CFG_RAW_RDY_EN | INT_CFG_ITG_RDY_EN);
   this->write(ITG_ADDR, PWR_MGM, PWR_MGM_CLK_SEL_0);
   rangeITG3200 = 512/14.375/CDR; // rad/s / lb
@@ -138,25 +209,45 @@ int32 SENSORS::read2(uint16 I2Caddr, uint8 regH, uint8 regL, boolean UintToInt)
 
 void SENSORS::readADXL345() {
   float fact = 2*rangeADXL345 / (1<<10);
-  measureADXL345[0] = fact * this->read(ADXL_ADDR, DATAX0, 2, true, READ_LB_FIRST);
-  measureADXL345[1] = fact * this->read(ADXL_ADDR, DATAY0, 2, true, READ_LB_FIRST);
-  measureADXL345[2] = fact * this->read(ADXL_ADDR, DATAZ0, 2, true, READ_LB_FIRST);
+  rawADXL345[0] = this->read(ADXL_ADDR, DATAX0, 2, true, READ_LB_FIRST);
+  rawADXL345[1] = this->read(ADXL_ADDR, DATAY0, 2, true, READ_LB_FIRST);
+  rawADXL345[2] = this->read(ADXL_ADDR, DATAZ0, 2, true, READ_LB_FIRST);
+  for (uint8 i=0 ; i<3 ; i++) measureADXL345[i] = fact * rawADXL345[i];
   if (enableZeros) AddA( measureADXL345, 1, zeroADXL345, -1, 3 );
 }
 
+// La lecture de INT_SOURCE acquitte les interruptions : on voit donc chaque transition une seule fois
+void SENSORS::readADXL345Int() {
+  uint8 source = this->read(ADXL_ADDR, INT_SOURCE);
+  intADXL345 = source;
+  if ((source & INACTIVITY) && !still) {
+    still = true;
+    motionChanged = true;
+  }
+  if ((source & ACTIVITY) && still) {
+    still = false;
+    motionChanged = true;
+  }
+}
+
 void SENSORS::readITG3200() {
   float fact = 2*rangeITG3200 / (1<<10);
-  measureITG3200[0] = fact * this->read2(ITG_ADDR, GYRO_XOUT_H, GYRO_XOUT_L, true);
-  measureITG3200[1] = fact * this->read2(ITG_ADDR, GYRO_YOUT_H, GYRO_YOUT_L, true);
-  measureITG3200[2] = fact * this->read2(ITG_ADDR, GYRO_ZOUT_H, GYRO_ZOUT_L, true);
+  rawITG3200[0] = this->read2(ITG_ADDR, GYRO_XOUT_H, GYRO_XOUT_L, true);
+  rawITG3200[1] = this->read2(ITG_ADDR, GYRO_YOUT_H, GYRO_YOUT_L, true);
+  rawITG3200[2] = this->read2(ITG_ADDR, GYRO_ZOUT_H, GYRO_ZOUT_L, true);
+  for (uint8 i=0 ; i<3 ; i++) measureITG3200[i] = fact * rawITG3200[i];
 }
 
 void SENSORS::readMAG3110() {
   // Le MAG3110 n'est pas orienté comme les autres capteurs : on effectue donc l'opération X=Y et Y=-X
+  // Les mesures brutes restent dans les axes du capteur
   float fact = 2*rangeMAG3110 / (1<<10);
-  measureMAG3110[0] =  fact * this->read2(MAG_ADDR, MAG_OUT_Y_MSB, MAG_OUT_Y_LSB, true);
-  measureMAG3110[1] = -fact * this->read2(MAG_ADDR, MAG_OUT_X_MSB, MAG_OUT_X_LSB, true);
-  measureMAG3110[2] =  fact * this->read2(MAG_ADDR, MAG_OUT_Z_MSB, MAG_OUT_Z_LSB, true);
+  rawMAG3110[0] = this->read2(MAG_ADDR, MAG_OUT_X_MSB, MAG_OUT_X_LSB, true);
+  rawMAG3110[1] = this->read2(MAG_ADDR, MAG_OUT_Y_MSB, MAG_OUT_Y_LSB, true);
+  rawMAG3110[2] = this->read2(MAG_ADDR, MAG_OUT_Z_MSB, MAG_OUT_Z_LSB, true);
+  measureMAG3110[0] =  fact * rawMAG3110[1];
+  measureMAG3110[1] = -fact * rawMAG3110[0];
+  measureMAG3110[2] =  fact * rawMAG3110[2];
   if (enableZeros) AddA( measureMAG3110, 1, zeroMAG3110, -1, 3 );
 }
 
@@ -174,6 +265,7 @@ boolean SENSORS::readBMP085() {
   if (this->BMPstate == BMP085_ASK_TEMP) this->write(BMP085_ADDR, BMP085_CONTROL, BMP085_READTEMPCMD);
   if (this->BMPstate == BMP085_READ_TEMP) {
     UT = this->read(BMP085_ADDR, BMP085_TEMPDATA, 2);
+    rawBMP085 |= RAW_BMP_UT;
     X1 = ((UT - (int32)ac6) * (int32)ac5) >> 15;
     X2 = ((int32)mc << 11) / (X1 + (int32)md);
     B5 = X1 + X2;
@@ -186,6 +278,7 @@ boolean SENSORS::readBMP085() {
     UP <<= 8;
     UP |= this->read(BMP085_ADDR, BMP085_PRESSUREDATA+2, 1); // Précision supplémentaire éventuelle
     UP >>= (8 - oversampling);
+    rawBMP085 |= RAW_BMP_UP;
 
     B6 = B5 - 4000;
 
@@ -222,22 +315,52 @@ boolean SENSORS::readBMP085() {
   else return false;
 }
 
-float SENSORS::altitude() {
-  return 44330 * (1 - (1-this->refAlt/44330) * pow(this->pressure/this->refPress, 1/5.255) );
+// Coefficients d'étalonnage du BMP085 dans l'ordre de ses registres (AC1 à MD), puis le
+// suréchantillonnage : de quoi refaire hors ligne le calcul de readBMP085()
+void SENSORS::calibBMP085(uint16 *cal) {
+  const uint16 values[BMP085_CAL_LENGTH] = { ac1, ac2, ac3, ac4, ac5, ac6, b1, b2, mb, mc, md, oversampling };
+  for (uint8 i=0 ; i<BMP085_CAL_LENGTH ; i++) cal[i] = values[i];
 }
 
 boolean SENSORS::loop() {
   if (this->I2C_err != 0) this->setup();
   else {
+    uint32 tick = tickTime;
+    if (fixedDt) {
+      // Seul le producteur touche à la fenêtre : les lecteurs de l'instantané ne la remettent
+      // pas à zéro, et aucun pic n'est perdu entre deux lectures
+      latency = micros() - tick;
+      if (latency > latencyPeak) latencyPeak = latency;
+      if (tick - latencyStart >= LATENCY_WINDOW) {
+        latencyMax = latencyPeak;
+        latencyPeak = 0;
+        latencyStart = tick;
+      }
+    }
     readADXL345();
+    readADXL345Int();
     readITG3200();
     readMAG3110();
+    rawBMP085 = 0;
     readBMP085();
     if (this->I2C_err == 0) {
       uint32 time = micros();
-      dt = (float)(time-lastLoop)/1000000;
-      if (lastLoop>time) dt += pow(256,4)/1000000; // Overflow de micros()
+      dtLoop = (float)(time-lastLoop)/1000000; // La soustraction d'uint32 gère l'overflow de micros()
       lastLoop = time;
+      if (fixedDt) {
+        // Un top manqué (tâche retardée par un effacement de Flash ou de carte SD...) ne doit
+        // pas disparaître : le pas du filtre couvre tous les tops écoulés
+        uint32 count = tickCount;
+        ticks = max(count - lastCount, 1);
+        lastCount = count;
+        missedTicks += ticks - 1;
+        dt = ticks * (float)samplePeriod / 1000000;
+        timeMeasure = tick;
+      }
+      else {
+        dt = dtLoop;
+        timeMeasure = time;
+      }
       return true;
     }
   }
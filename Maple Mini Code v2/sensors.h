@@ -263,9 +263,32 @@
 // Paramètres
 #define READ_MAX_LENGTH	2	// Nombre maxi d'octets lus par la méthode read(...)
 
+// Détection d'activité de l'ADXL345 (62.5 mg/lb, 1 s/lb)
+#define ADXL_THRESH_ACT		4	// 0.25 g
+#define ADXL_THRESH_INACT	2	// 0.125 g
+#define ADXL_TIME_INACT		10	// 10 s d'immobilité avant de passer en basse consommation
+
+// Détection de chute libre de l'ADXL345 (62.5 mg/lb, 5 ms/lb)
+#define ADXL_THRESH_FF		7	// 0.44 g sur les trois axes
+#define ADXL_TIME_FF		20	// pendant 100 ms
+
+// Fréquences d'échantillonnage
+#define ADXL_RATE_FULL		0x0A	// 100 Hz
+#define ADXL_RATE_LOW		0x07	// 12.5 Hz
+#define ITG_DIV_FULL		9	// 1 kHz / (9+1) = 100 Hz
+#define ITG_DIV_LOW		79	// 12.5 Hz
+#define MAG_DR_FULL		0	// 80 Hz
+#define MAG_DR_LOW		3	// 10 Hz
+
+#define LATENCY_WINDOW		1000000	// Fenêtre du retard maxi (µs), au moins la période d'envoi de JITTER
+
 // Constantes
 #define READ_HB_FIRST	false
 #define READ_LB_FIRST	true
+#define TEMPERATURE_UNKNOWN	-1000
+#define RAW_BMP_UT		(1<<0)	// rawBMP085 : UT lu pendant le dernier loop()
+#define RAW_BMP_UP		(1<<1)	// rawBMP085 : UP lu pendant le dernier loop()
+#define BMP085_CAL_LENGTH	12	// Mots renvoyés par calibBMP085()
 
 class SENSORS {
 private:
@@ -280,11 +303,15 @@ private:
   void setupMAG3110();
 
   void readADXL345();
+  void readADXL345Int();
   void readITG3200();
   void readMAG3110();
   boolean readBMP085();
 
   uint32 lastLoop;
+  uint32 lastCount;	// Nombre de tops au loop() précédent
+  uint32 latencyPeak;	// Retard maxi de la fenêtre en cours (µs)
+  uint32 latencyStart;	// Début (micros) de la fenêtre en cours
 
   // Variables associées au BMP085
   uint8 oversampling;
@@ -292,7 +319,6 @@ private:
   uint16 ac4, ac5, ac6;
   int32 X1, X2, X3, B3, B5, B6, p;
   uint32 B4, B7;
-  uint32 UT, UP;
   uint32 BMPlastTime;
   uint8 BMPstate;
 
@@ -302,6 +328,20 @@ public:
   void setup();
   boolean loop();
 
+  // Echantillonnage sur interruption d'un timer : dt est alors constant et égal à la période
+  // handler est appelé sous interruption à chaque top (par exemple pour réveiller l'ordonnanceur)
+  void setupTimer(uint32 period, voidFuncPtr handler = NULL);
+  boolean fixedDt;
+  uint32 samplePeriod;	// Période d'échantillonnage sur interruption (µs), 0 si désactivé
+  uint32 ticks;		// Tops couverts par la dernière mesure (1 sauf retard de plus d'une période)
+  uint32 missedTicks;	// Tops manqués depuis le démarrage
+
+  // Basse consommation : la centrale est immobile depuis ADXL_TIME_INACT secondes
+  void setLowPower(boolean low);
+  boolean still;	// Dernier état signalé par l'ADXL345
+  boolean motionChanged;	// still a changé depuis la dernière lecture (à remettre à faux)
+  uint8 intADXL345;	// Interruptions de l'ADXL345 (INT_SOURCE) apparues depuis le loop() précédent
+
   int32 I2C_err;
 
   // Amplitudes extremes
@@ -315,14 +355,25 @@ public:
   float zeroMAG3110[3];
 
   // Mesures
-  float dt;
+  float dt;		// Pas de temps du filtre (s) : ticks périodes si fixedDt
+  float dtLoop;		// Durée réelle entre les deux dernières mesures (s)
+  uint32 timeMeasure;	// Date (micros) de la dernière mesure (du top d'échantillonnage si fixedDt)
+  uint32 latency;	// Retard de la lecture sur le top d'échantillonnage (µs)
+  uint32 latencyMax;	// Retard maxi sur la dernière fenêtre LATENCY_WINDOW achevée (µs)
   float measureADXL345[3];
   float measureITG3200[3];
   float measureMAG3110[3];
   float refAlt, refPress;
   float temperature;
   float pressure;
-  float altitude();
+
+  // Mesures brutes (points des convertisseurs, avant zéros et changement d'axes)
+  int16 rawADXL345[3];
+  int16 rawITG3200[3];
+  int16 rawMAG3110[3];
+  uint8 rawBMP085;	// RAW_BMP_... : lectures du BMP085 faites pendant le dernier loop()
+  uint32 UT, UP;
+  void calibBMP085(uint16 *cal);
 
 };
 
@@ -0,0 +1,46 @@
+// Instantané cohérent de l'état du filtre et des mesures, publié à chaque itération
+// Matthias Lemainque 2013
+
+#include "snapshot.h"
+
+void SNAPSHOT::invalidate() {
+  validCardan = false;
+  validProj = false;
+  validAltitude = false;
+}
+
+float* SNAPSHOT::getCardan() {
+  if (!validCardan) {
+    CalcCardan(Cardan, Q);
+    validCardan = true;
+  }
+  return Cardan;
+}
+
+float* SNAPSHOT::getADXL345_0() {
+  if (!validProj) {
+    CalcProj(measureADXL345_0, measureMAG3110_0, Q);
+    validProj = true;
+  }
+  return measureADXL345_0;
+}
+
+float* SNAPSHOT::getMAG3110_0() {
+  getADXL345_0(); // Les deux projections sont calculées ensemble
+  return measureMAG3110_0;
+}
+
+float SNAPSHOT::getAltitude() {
+  if (!validAltitude) {
+    altitude = 44330 * (1 - (1-refAlt/44330) * fastPowBaro(pressure/refPress) );
+    validAltitude = true;
+  }
+  return altitude;
+}
+
+// Extrapolation à partir de la dernière vitesse de rotation : permet de dater l'orientation
+// de l'instant d'émission et non de celui de la mesure
+void SNAPSHOT::predictAt(float *res, uint32 newTime) {
+  float dt = (float)(int32)(newTime-time) / 1000000; // La soustraction d'uint32 gère l'overflow de micros()
+  IntegQ(res, Q, W, dt);
+}
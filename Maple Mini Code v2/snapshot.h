@@ -0,0 +1,46 @@
+// Instantané cohérent de l'état du filtre et des mesures, publié à chaque itération
+// Matthias Lemainque 2013
+
+#ifndef _SNAPSHOT_H_
+#define _SNAPSHOT_H_
+
+#include "wirish.h"
+#include "maths.h"
+
+// Empêche le compilateur de réordonner les accès mémoire de part et d'autre
+// (le Cortex-M3 est mono-cœur : aucune barrière matérielle n'est nécessaire)
+#define COMPILER_BARRIER()	asm volatile("" ::: "memory")
+
+class SNAPSHOT {
+private:
+  // Sorties dérivées, calculées à la demande par le lecteur sur sa propre copie
+  boolean validCardan, validProj, validAltitude;
+  float Cardan[3];
+  float measureADXL345_0[3];
+  float measureMAG3110_0[3];
+  float altitude;
+
+public:
+  void invalidate();
+
+  uint32 time;		// Date (micros) de la mesure
+  float Q[4];		// Quaternion
+  float W[3];		// Vitesse de rotation corrigée du biais (rad/s)
+  uint8 fidelity;	// Niveau de fidélité du filtre
+  uint32 latencyMax;	// Retard maxi de l'échantillonnage sur le top du timer, sur la dernière fenêtre LATENCY_WINDOW (µs)
+
+  float measureADXL345[3];
+  float measureITG3200[3];
+  float measureMAG3110[3];
+  float temperature;
+  float pressure;
+  float refAlt, refPress;	// Référence de l'altitude (m, Pa)
+
+  float* getCardan();
+  float* getADXL345_0();
+  float* getMAG3110_0();
+  float getAltitude();
+  void predictAt(float *res, uint32 newTime); // Quaternion extrapolé à la date newTime (micros)
+};
+
+#endif // _SNAPSHOT_H_
@@ -81,10 +81,10 @@ boolean FLASH::write() {
   return lock();
 }
 
-boolean FLASH::write(uint8 i, uint16 value) {
+boolean FLASH::write(uint8 i, uint16 value, boolean save) {
   if (i >= DATA_LENGTH) return false;
   data[i] = value;
-  return write();
+  return save ? write() : true;
 }
 
 void FLASH::readT8(uint8 *tab, uint8 pos, uint8 len) {
@@ -94,18 +94,18 @@ void FLASH::readT8(uint8 *tab, uint8 pos, uint8 len) {
   }
 }
 
-boolean FLASH::writeT8(const uint8 *tab, uint8 pos, uint8 len) {
+boolean FLASH::writeT8(const uint8 *tab, uint8 pos, uint8 len, boolean save) {
   for (uint8 i=0 ; i<len ; i++) data[i+pos] = tab[2*i]<<8 | tab[2*i+1];
-  return write();
+  return save ? write() : true;
 }
 
 void FLASH::readTf(float *tab, uint8 pos, uint8 len, float range) {
   for (uint8 i=0 ; i<len ; i++) tab[i] = itof( data[i+pos], -range, range, 16 );
 }
 
-boolean FLASH::writeTf(const float *tab, uint8 pos, uint8 len, float range) {
+boolean FLASH::writeTf(const float *tab, uint8 pos, uint8 len, float range, boolean save) {
   for (uint8 i=0 ; i<len ; i++) data[i+pos] = ftoi( tab[i], -range, range, 16 );
-  return write();
+  return save ? write() : true;
 }
 
 
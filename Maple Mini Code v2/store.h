@@ -10,15 +10,28 @@
 
 // Paramètres
 #define STORE_PAGE		125		// Doit être compris entre 120 et 127
-#define DATA_LENGTH		24		// Nombre de variables de 16 bits (entre 0 et 512)
+#define DATA_LENGTH		48		// Nombre de variables de 16 bits (entre 0 et 512)
 
 // Constantes
 // Addresses paramètres
 #define FLASH_ZERO_ADXL		0
 #define FLASH_ZERO_MAG		3
 #define FLASH_PARAM		6
-#define FLASH_MAIN_MASK		7
-#define FLASH_AUX_MASK		7
+#define FLASH_MAIN_MASK		7	// 5 mots : 10 octets
+#define FLASH_AUX_MASK		12	// 10 mots : 20 octets
+
+// Sauvegarde de l'état du filtre de Kalman
+#define FLASH_KALMAN_VALID	22	// Vaut FLASH_KALMAN_MAGIC si la sauvegarde est valide
+#define FLASH_KALMAN_TEMP	23	// Température lors de la sauvegarde
+#define FLASH_KALMAN_QUAT	24	// 4 mots : quaternion
+#define FLASH_KALMAN_BIAS	28	// 3 mots : biais gyroscopique
+#define FLASH_KALMAN_ET		31	// 11 mots : écarts-types (racine de la diagonale de P)
+#define FLASH_KALMAN_MAGIC	0x4B41
+
+// Masques de télémétrie (FLASH_MAIN_MASK, FLASH_AUX_MASK) enregistrés par le client
+#define FLASH_MASK_VALID	42	// Vaut FLASH_MASK_MAGIC si les masques ont été enregistrés
+#define FLASH_AUX_LENGTH	43	// lenAux
+#define FLASH_MASK_MAGIC	0x4D41
 
 // Flash
 #define FLASH_BASE_ADDRESS	0x08000000	// Début de la mémoire flash 134217728
@@ -38,13 +51,14 @@ public:
   void read();
   boolean erase();
   boolean write();
-  boolean write(uint8 i, uint16 value);
+  boolean write(uint8 i, uint16 value, boolean save = true);
 
+  // Si save est faux, on ne modifie que data : il faudra appeler write() pour écrire la page
   void readT8(uint8 *tab, uint8 pos, uint8 len);
-  boolean writeT8(const uint8 *tab, uint8 pos, uint8 len);
+  boolean writeT8(const uint8 *tab, uint8 pos, uint8 len, boolean save = true);
   
   void readTf(float *tab, uint8 pos, uint8 len, float range);
-  boolean writeTf(const float *tab, uint8 pos, uint8 len, float range);
+  boolean writeTf(const float *tab, uint8 pos, uint8 len, float range, boolean save = true);
 
 };
 
@@ -0,0 +1,311 @@
+// Schéma de télémétrie : description unique des champs envoyés par LOG
+// Partagé tel quel par le micrologiciel (encodeur) et le décodeur du client (Host decoder/)
+// Matthias Lemainque 2013
+
+#ifndef _TELEMETRY_H_
+#define _TELEMETRY_H_
+
+#include <stdint.h>
+#include <math.h>
+#include "framing.h"
+
+// Codages
+#define TM_LINEAR		0	// Réels ramenés linéairement (arrondi) de [min,max] à [0,2^bits-1]
+#define TM_QUAT			1	// Quaternion normé, "trois plus petites" : 2 bits pour l'indice de la plus grande
+					// coordonnée, puis les 3 autres en TM_LINEAR sur [-1/√2,1/√2]
+#define TM_KEY			2	// Clé de contrôle du paquet (calculée par LOG pendant l'envoi)
+#define TM_UINT			3	// Entiers non signés fournis tels quels, sur bits/8 octets chacun (poids forts en tête)
+
+// Plages fixes des capteurs (cf. SENSORS::setup)
+#define TM_ACC_RANGE		(2*9.81f)	// m/s²
+#define TM_MAG_RANGE		(512*0.1f)	// uT
+#define TM_GYR_RANGE		35.0f		// rad/s (±2000 °/s)
+#define TM_QUAT_RANGE		0.70710678f	// 1/√2 : plage des 3 plus petites coordonnées d'un quaternion normé
+
+#define TM_MAX_COUNT		4	// Nombre maxi de valeurs par champ
+#define TM_MAX_LENGTH		16	// Taille maxi d'un champ (octets)
+
+// Table des champs : chaque ligne donne le code (implicite, dans l'ordre), le nom, le codage,
+// le nombre de valeurs, les bits par valeur, la plage, et l'instruction qui remplit v[] (u[] pour
+// TM_UINT) côté micrologiciel (évaluée dans LOG::encodeField, ignorée par le décodeur)
+//  F( nom,       codage,    n, bits, min,            max,           source )
+#define TELEMETRY_FIELDS(F) \
+  F( KEY,      TM_KEY,    1, 8,  0,             255,           ; )                                    /*  0 */ \
+  F( DT,       TM_LINEAR, 1, 8,  0,             255,           v[0] = dtPacket() )                    /*  1 */ \
+  F( QUAT_5,   TM_QUAT,   3, 12, -TM_QUAT_RANGE, TM_QUAT_RANGE, Snap.predictAt(v, txTime) )            /*  2 */ \
+  F( QUAT_8,   TM_QUAT,   3, 20, -TM_QUAT_RANGE, TM_QUAT_RANGE, Snap.predictAt(v, txTime) )            /*  3 */ \
+  F( TEMP,     TM_LINEAR, 1, 8,  -5,            45,            v[0] = Snap.temperature )              /*  4 */ \
+  F( PRESS,    TM_LINEAR, 1, 16, 30000,         1200000,       v[0] = Snap.pressure )                 /*  5 */ \
+  F( ALTI,     TM_LINEAR, 1, 16, -500,          7000,          v[0] = Snap.getAltitude() )            /*  6 */ \
+  F( ACC_6,    TM_LINEAR, 3, 16, -TM_ACC_RANGE, TM_ACC_RANGE,  CopyA(v, Snap.measureADXL345, 3) )     /*  7 */ \
+  F( ACC0_3,   TM_LINEAR, 3, 8,  -TM_ACC_RANGE, TM_ACC_RANGE,  CopyA(v, Snap.getADXL345_0(), 3) )     /*  8 */ \
+  F( ACC0_6,   TM_LINEAR, 3, 16, -TM_ACC_RANGE, TM_ACC_RANGE,  CopyA(v, Snap.getADXL345_0(), 3) )     /*  9 */ \
+  F( MAG_6,    TM_LINEAR, 3, 16, -TM_MAG_RANGE, TM_MAG_RANGE,  CopyA(v, Snap.measureMAG3110, 3) )     /* 10 */ \
+  F( MAG0_3,   TM_LINEAR, 3, 8,  -100,          100,           CopyA(v, Snap.getMAG3110_0(), 3) )     /* 11 */ \
+  F( MAG0_6,   TM_LINEAR, 3, 16, -TM_MAG_RANGE, TM_MAG_RANGE,  CopyA(v, Snap.getMAG3110_0(), 3) )     /* 12 */ \
+  F( GYRZ_6,   TM_LINEAR, 3, 16, -TM_GYR_RANGE, TM_GYR_RANGE,  CopyA(v, Snap.W, 3) )                  /* 13 */ \
+  F( FIDELITY, TM_LINEAR, 1, 8,  0,             255,           v[0] = Snap.fidelity )                 /* 14 */ \
+  F( JITTER,   TM_LINEAR, 1, 16, 0,             65535,         v[0] = jitterPacket() )                /* 15 */ \
+  F( QUAT_4,   TM_QUAT,   3, 10, -TM_QUAT_RANGE, TM_QUAT_RANGE, Snap.predictAt(v, txTime) )            /* 16 */ \
+  F( TIME,     TM_UINT,   1, 24, 0,             0xFFFFFF,      u[0] = txTime - syncTime )             /* 17 */ \
+  F( SYNC,     TM_UINT,   1, 32, 0,             0xFFFFFFFF,    u[0] = syncPacket() )                  /* 18 */ \
+  F( ECHO,     TM_UINT,   3, 32, 0,             0xFFFFFFFF,    replyPacket(u); u[2] = txTime )        /* 19 */ \
+  F( ACK,      TM_UINT,   2, 8,  0,             0xFF,          replyPacket(u) )                       /* 20 */ \
+  F( PARAM,    TM_UINT,   2, 32, 0,             0xFFFFFFFF,    replyPacket(u) )                       /* 21 */ \
+  F( PERF,     TM_UINT,   4, 32, 0,             0xFFFFFFFF,    replyPacket(u) )                       /* 22 */
+
+// Datation : chaque paquet a une date d'émission unique (µs), à laquelle les quaternions sont
+// extrapolés ; TIME la donne comptée depuis la dernière SYNC, qui donne la date absolue
+// (micros() de la Maple). ECHO répond à une commande de ping de l'ordinateur
+// client : date du client renvoyée telle quelle, date de réception et date d'émission (µs).
+// Réponses aux commandes (cf. framing.h) : ACK (séquence de la commande, état ACK_...), PARAM
+// (identifiant, valeur), PERF (zone en poids forts et nombre de mesures sur 24 bits, cycles
+// mini, moyens, maxi).
+// Codes des champs (MASK_KEY = 0, MASK_DT = 1, ...)
+#define TM_ENUM(name, codec, n, bits, min, max, src)	MASK_##name,
+enum { TELEMETRY_FIELDS(TM_ENUM) TM_FIELDS };
+#define MASK_END		255
+
+// Tout ce qui dépend du schéma est calculé à la compilation
+#define TM_BITS(codec, n, bits)		((n)*(bits) + 2*((codec) == TM_QUAT))
+#define TM_LENGTH(codec, n, bits)	((TM_BITS(codec, n, bits) + 7) / 8)
+#define TM_SCALE(bits, min, max)	((float)((1ULL<<(bits))-1) / ((float)(max)-(float)(min)))
+
+struct TM_FIELD {
+  const char *name;
+  uint8_t codec;
+  uint8_t count;	// Nombre de valeurs
+  uint8_t bits;		// Bits par valeur
+  uint8_t length;	// Taille du champ (octets)
+  float min;
+  float scale;		// Pas de quantification inverse : (2^bits-1)/(max-min)
+};
+
+#define TM_ENTRY(name, codec, n, bits, min, max, src) \
+  { #name, codec, n, bits, TM_LENGTH(codec, n, bits), (float)(min), TM_SCALE(bits, min, max) },
+static const TM_FIELD TM_SCHEMA[TM_FIELDS] = { TELEMETRY_FIELDS(TM_ENTRY) };
+
+// SYNC et les réponses aux commandes sont envoyées par LOG à la demande : elles ne peuvent
+// pas figurer dans les masques
+#define TM_FIRST_REPLY		MASK_SYNC
+
+// Longueur d'un champ, 0 pour un code inconnu (dont MASK_END)
+inline uint8_t tmLength(uint8_t code) {
+  return (code < TM_FIELDS) ? TM_SCHEMA[code].length : 0;
+}
+
+// Un masque de length codes se lit par mots de 4 codes (PARAM_MASK_..., cf. framing.h) : le
+// mot i porte les codes 4i à 4i+3, le premier en poids fort, complétés par MASK_END
+#define TM_MASK_WORDS(length)	(((length)+3) / 4)
+
+inline uint32_t tmMaskWord(const uint8_t *mask, uint8_t length, uint8_t i) {
+  uint32_t word = 0;
+  for (uint8_t j=4*i ; j<4*i+4 ; j++) word = (word << 8) | ((j < length) ? mask[j] : MASK_END);
+  return word;
+}
+
+inline void tmMaskUnword(uint32_t word, uint8_t *mask, uint8_t length, uint8_t i) {
+  for (uint8_t j=4*i ; j<4*i+4 ; j++)
+    if (j < length) mask[j] = word >> (8*(4*i+3-j));
+}
+
+
+// Nombre d'entiers après quantification (TM_QUAT : l'indice de la plus grande coordonnée en est un)
+inline uint8_t tmValues(uint8_t code) {
+  return TM_SCHEMA[code].count + (TM_SCHEMA[code].codec == TM_QUAT);
+}
+
+
+// * * * * * * * * * * * *
+//  E N C O D A G E
+// * * * * * * * * * * * *
+
+// Réels -> entiers sur f->bits (arrondi, saturation). Renvoit le nombre d'entiers.
+// TM_QUAT : q et -q représentent la même rotation, on choisit le signe qui rend la plus grande
+// coordonnée positive ; elle se déduit alors des 3 autres, toutes inférieures à 1/√2 en valeur absolue
+inline uint8_t tmQuantize(uint8_t code, const float *v, uint32_t *q) {
+  const TM_FIELD *f = &TM_SCHEMA[code];
+  if (f->codec == TM_UINT) {
+    for (uint8_t i=0 ; i<f->count ; i++) q[i] = v[i];
+    return f->count;
+  }
+  float w[TM_MAX_COUNT];
+  if (f->codec == TM_QUAT) {
+    uint8_t iMax = 0;
+    for (uint8_t i=1 ; i<4 ; i++)
+      if (fabsf(v[i]) > fabsf(v[iMax])) iMax = i;
+    float sign = (v[iMax] < 0) ? -1 : 1;
+    for (uint8_t i=0, j=0 ; i<4 ; i++)
+      if (i != iMax) w[j++] = sign*v[i];
+    q[f->count] = iMax;
+    v = w;
+  }
+  uint32_t top = (1UL << f->bits) - 1;
+  for (uint8_t i=0 ; i<f->count ; i++) {
+    float x = (v[i] - f->min) * f->scale + 0.5f;
+    q[i] = (x <= 0) ? 0 : (x >= top) ? top : (uint32_t)x;
+  }
+  return tmValues(code);
+}
+
+// Les entiers sont empilés bit à bit en partant du haut, le champ est complété par des zéros
+// jusqu'à l'octet. Renvoit le nombre d'octets écrits dans out.
+inline uint8_t tmPack(uint8_t code, const uint32_t *q, uint8_t *out) {
+  const TM_FIELD *f = &TM_SCHEMA[code];
+  if (f->codec == TM_UINT) {
+    uint8_t len = 0;
+    for (uint8_t i=0 ; i<f->count ; i++)
+      for (int8_t j=f->bits-8 ; j>=0 ; j-=8) out[len++] = q[i] >> j;
+    return len;
+  }
+  uint64_t data = 0;
+  uint8_t nBits = 0;
+  if (f->codec == TM_QUAT) { // L'indice en tête
+    data = q[f->count];
+    nBits = 2;
+  }
+  for (uint8_t i=0 ; i<f->count ; i++) {
+    data = (data << f->bits) | q[i];
+    nBits += f->bits;
+  }
+  data <<= 8*f->length - nBits;
+  for (uint8_t i=0 ; i<f->length ; i++)
+    out[i] = data >> (8*(f->length-1-i));
+  return f->length;
+}
+
+inline uint8_t tmEncode(uint8_t code, const float *v, uint8_t *out) {
+  uint32_t q[TM_MAX_COUNT];
+  tmQuantize(code, v, q);
+  return tmPack(code, q, out);
+}
+
+
+// * * * * * * * * * * * *
+//  D E C O D A G E
+// * * * * * * * * * * * *
+
+inline uint8_t tmUnpack(uint8_t code, const uint8_t *in, uint32_t *q) {
+  const TM_FIELD *f = &TM_SCHEMA[code];
+  if (f->codec == TM_UINT) {
+    uint8_t len = 0;
+    for (uint8_t i=0 ; i<f->count ; i++) {
+      q[i] = 0;
+      for (uint8_t j=0 ; j<f->bits ; j+=8) q[i] = (q[i] << 8) | in[len++];
+    }
+    return len;
+  }
+  uint64_t data = 0;
+  for (uint8_t i=0 ; i<f->length ; i++) data = (data << 8) | in[i];
+  uint8_t nBits = TM_BITS(f->codec, f->count, f->bits);
+  data >>= 8*f->length - nBits;
+  uint8_t shift = nBits;
+  if (f->codec == TM_QUAT) {
+    shift -= 2;
+    q[f->count] = (data >> shift) & 3;
+  }
+  for (uint8_t i=0 ; i<f->count ; i++) {
+    shift -= f->bits;
+    q[i] = (data >> shift) & ((1UL << f->bits) - 1);
+  }
+  return f->length;
+}
+
+// TM_QUAT : la plus grande coordonnée est reconstruite par la norme
+inline void tmDequantize(uint8_t code, const uint32_t *q, float *v) {
+  const TM_FIELD *f = &TM_SCHEMA[code];
+  if (f->codec == TM_UINT) {
+    for (uint8_t i=0 ; i<f->count ; i++) v[i] = q[i];
+    return;
+  }
+  for (uint8_t i=0 ; i<f->count ; i++)
+    v[i] = f->min + (float)q[i] / f->scale;
+  if (f->codec == TM_QUAT) {
+    uint8_t iMax = q[f->count];
+    float n2 = v[0]*v[0] + v[1]*v[1] + v[2]*v[2];
+    for (uint8_t i=3 ; i>iMax ; i--) v[i] = v[i-1];
+    v[iMax] = (n2 < 1) ? sqrtf(1 - n2) : 0;
+  }
+}
+
+inline uint8_t tmDecode(uint8_t code, const uint8_t *in, float *v) {
+  uint32_t q[TM_MAX_COUNT];
+  uint8_t n = tmUnpack(code, in, q);
+  tmDequantize(code, q, v);
+  return n;
+}
+
+
+// * * * * * * * * * * * * * * * *
+//  C O D A G E   D I F F E R E N T I E L
+// * * * * * * * * * * * * * * * *
+
+// Entre deux images clés, chaque entier est remplacé par son écart au dernier envoi, replié en
+// non signé (zigzag : 0,-1,1,-2... -> 0,1,2,3...) puis écrit par groupes de 7 bits, poids
+// faibles en premier, le bit 7 indiquant qu'un groupe suit (varint). Un écart de moins de 64
+// pas tient en 1 octet, de moins de 8192 pas en 2.
+#define TM_FRAME_ABS		0	// Valeurs absolues, sans référence (codage différentiel désactivé)
+#define TM_FRAME_KEY		1	// Image clé : valeurs absolues, qui deviennent la référence
+#define TM_FRAME_DELTA		2	// Ecarts à la référence
+
+// En-tête du paquet de télémétrie (un octet après la séquence de la trame) : génération du
+// masque principal (4 bits, cf. framing.h), nombre de champs hors masque placés en tête du
+// paquet (SYNC et réponses, 2 bits), puis codage du paquet principal (TM_FRAME_..., 2 bits).
+// Les champs hors masque se lisent ainsi sans connaître le masque : l'annonce d'un masque
+// perdu reste lisible.
+#define TM_GEN_MASK			0x0F
+#define TM_HEADER(gen, nReply, frame)	((uint8_t)(((gen) << 4) | ((nReply) << 2) | (frame)))
+#define TM_HEADER_GEN(h)		((h) >> 4)
+#define TM_HEADER_REPLIES(h)		(((h) >> 2) & 0x03)
+#define TM_HEADER_FRAME(h)		((h) & 0x03)
+#define TM_MAX_REPLIES			3	// Champs hors masque au plus par paquet
+
+#define TM_VARINT_LENGTH(bits)		(((bits)+1+6) / 7)
+#define TM_MAX_DELTA_LENGTH		(4*TM_VARINT_LENGTH(32))	// Pire cas : PERF, au moins TM_MAX_LENGTH
+
+inline uint8_t tmPackDelta(uint8_t code, const uint32_t *q, const uint32_t *ref, uint8_t *out) {
+  uint8_t len = 0;
+  for (uint8_t i=0 ; i<tmValues(code) ; i++) {
+    int32_t d = (int32_t)(q[i] - ref[i]);
+    uint32_t z = ((uint32_t)d << 1) ^ (uint32_t)(d >> 31);
+    while (z >= 0x80) {
+      out[len++] = (z & 0x7F) | 0x80;
+      z >>= 7;
+    }
+    out[len++] = z;
+  }
+  return len;
+}
+
+// Renvoit le nombre d'octets lus, 0 si le champ dépasse les n octets disponibles
+inline uint8_t tmUnpackDelta(uint8_t code, const uint8_t *in, uint8_t n, const uint32_t *ref, uint32_t *q) {
+  uint8_t len = 0;
+  for (uint8_t i=0 ; i<tmValues(code) ; i++) {
+    uint32_t z = 0;
+    uint8_t shift = 0;
+    do {
+      if ((len >= n) || (shift > 28)) return 0;
+      z |= (uint32_t)(in[len] & 0x7F) << shift;
+      shift += 7;
+    } while (in[len++] & 0x80);
+    int32_t d = (int32_t)(z >> 1) ^ -(int32_t)(z & 1);
+    q[i] = ref[i] + d;
+  }
+  return len;
+}
+
+
+// * * * * * * * * * * * * * * * *
+//  D I M E N S I O N S   D U   P A Q U E T
+// * * * * * * * * * * * * * * * *
+
+// Bornes communes à LOG et au décodeur du client (tampons de réception)
+#define MAIN_MASK_LENGTH	10
+#define AUX_MAX_LENGTH		32	// Taille maxi du paquet auxiliaire (lenAux est ramené à cette valeur)
+#define REPLY_PER_PACKET	2	// Réponses envoyées au plus par paquet (avec SYNC, au plus TM_MAX_REPLIES)
+
+// En-tête, paquet principal différentiel au pire, SYNC, réponses, paquet auxiliaire
+#define PACKET_MAX_LENGTH	(1 + MAIN_MASK_LENGTH*TM_MAX_DELTA_LENGTH + (1+4) + REPLY_PER_PACKET*(1+TM_MAX_LENGTH) + AUX_MAX_LENGTH)
+#define FRAME_MAX_LENGTH	FRAME_LENGTH(PACKET_MAX_LENGTH)
+
+#endif // _TELEMETRY_H_